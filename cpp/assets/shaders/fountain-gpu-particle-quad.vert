@@ -0,0 +1,29 @@
+#version 450
+
+// The particles simulated by fountain-gpu-update.vert, drawn as instanced
+// quads instead of being expanded by the geometry shader.
+
+const float PARTICLE_SIZE = 0.001;
+
+layout(location = 0) in vec2 position;
+layout(location = 2) in float age;
+layout(location = 3) in float lifetime;
+layout(location = 4) in vec2 corner;
+
+out Fragment {
+    vec2 uv;
+    float alpha;
+} frag;
+
+void main() {
+    float a = age < 0.0 ? 0.0 : 1.0 - age / lifetime;
+
+    frag.uv = corner * PARTICLE_SIZE;
+    frag.alpha = a;
+
+    // Collapse the quad outside the screen if not visible
+    if (a <= 0.0)
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+    else
+        gl_Position = vec4(position + frag.uv, 0.0, 1.0);
+}
@@ -0,0 +1,17 @@
+#version 450
+
+// Draws the particles simulated by fountain-gpu-update.vert
+
+layout(location = 0) in vec2 position;
+layout(location = 2) in float age;
+layout(location = 3) in float lifetime;
+
+out Particle {
+    vec2 pos;
+    float alpha;
+};
+
+void main() {
+    pos = position;
+    alpha = age < 0.0 ? 0.0 : 1.0 - age / lifetime;
+}
@@ -0,0 +1,36 @@
+#version 450
+
+// The parametric particles of fountain-gpu.vert, drawn as instanced quads
+// instead of being expanded by the geometry shader. The particle attributes
+// advance once per instance, the corner once per vertex.
+
+const float PARTICLE_SIZE = 0.001;
+
+layout(location = 0) in vec2 pos0;
+layout(location = 1) in vec2 vel0;
+layout(location = 2) in vec2 acceleration;
+layout(location = 3) in float emitTime;
+layout(location = 4) in vec2 corner;
+
+out Fragment {
+    vec2 uv;
+    float alpha;
+} frag;
+
+uniform float time;
+uniform float lifetime;
+
+void main() {
+    float t = time - emitTime;
+    vec2 pos = pos0 + vel0 * t + acceleration * (0.5 * t * t);
+    float a = (t - 0.0) * (0.0 - 1.0) / (lifetime - 0.0) + 1.0;
+
+    frag.uv = corner * PARTICLE_SIZE;
+    frag.alpha = max(a, 0.0);
+
+    // Collapse the quad outside the screen if not visible
+    if (a <= 0.0)
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+    else
+        gl_Position = vec4(pos + frag.uv, 0.0, 1.0);
+}
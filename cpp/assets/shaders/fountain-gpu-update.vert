@@ -0,0 +1,76 @@
+#version 450
+
+// Advances every particle by one step. The particles are read from one buffer
+// and written to the other with transform feedback, so they never leave the
+// GPU. Dead particles respawn at the emitter in the same pass.
+
+layout(location = 0) in vec2 pos;
+layout(location = 1) in vec2 vel;
+layout(location = 2) in float age;
+layout(location = 3) in float lifetime;
+
+out vec2 outPos;
+out vec2 outVel;
+out float outAge;
+out float outLifetime;
+
+uniform float dt;
+uniform uint seed; // Different every step
+
+// Forces
+uniform vec2 gravity;
+uniform vec2 wind;
+uniform float drag; // How fast particles take on the wind velocity
+
+// Emitter
+uniform vec2 emitterPos;
+uniform float emitterAngle; // Radians
+uniform float spread;       // Radians to either side of the angle
+uniform vec2 speed;         // Min and max
+uniform vec2 lifetimes;     // Min and max
+
+// PCG hash, the same bits on every GPU and on the CPU
+uint hash(uint v) {
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// A uniform float in [0, 1)
+float random(inout uint state) {
+    state = hash(state);
+    return float(state >> 8u) * (1.0 / 16777216.0);
+}
+
+void main() {
+    float a = age + dt;
+
+    // Respawn, carrying the time past the end of the old life over
+    if (a >= lifetime) {
+        uint state = hash(uint(gl_VertexID) ^ seed);
+        float angle = emitterAngle + (2.0 * random(state) - 1.0) * spread;
+        float s = mix(speed.x, speed.y, random(state));
+
+        outPos = emitterPos;
+        outVel = vec2(cos(angle), sin(angle)) * s;
+        outAge = a - lifetime;
+        outLifetime = mix(lifetimes.x, lifetimes.y, random(state));
+        return;
+    }
+
+    // Not born yet
+    if (a < 0.0) {
+        outPos = pos;
+        outVel = vel;
+        outAge = a;
+        outLifetime = lifetime;
+        return;
+    }
+
+    // Semi-implicit Euler
+    vec2 acc = gravity + drag * (wind - vel);
+    outVel = vel + acc * dt;
+    outPos = pos + outVel * dt;
+    outAge = a;
+    outLifetime = lifetime;
+}
@@ -2,6 +2,8 @@
 
 layout(location = 0) in vec2 pos0;
 layout(location = 1) in vec2 vel0;
+layout(location = 2) in vec2 acceleration;
+layout(location = 3) in float emitTime;
 
 out Particle {
     vec2 pos;
@@ -9,12 +11,11 @@ out Particle {
 };
 
 uniform float time;
-uniform vec2 acceleration;
+uniform float lifetime;
 
 void main() {
-    float t = time;
-    float lifetime = 2.0;
+    float t = time - emitTime;
     pos = pos0 + vel0 * t + acceleration * (0.5 * t * t);
     float a = (t - 0.0) * (0.0 - 1.0) / (lifetime - 0.0) + 1.0;
     alpha = max(a, 0.0);
-}
\ No newline at end of file
+}
@@ -7,6 +7,13 @@
  */
 
 #include "common.h"
+#include "random.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 
 // Constants
 // ***********************************************************************
@@ -15,12 +22,40 @@ constexpr uint32_t WINDOWY          = 1000;
 constexpr float    BALL_RADIUS      = 50.0f;
 constexpr uint32_t BALL_POINT_COUNT = 20;
 constexpr size_t   BALL_COUNT       = 10;
+constexpr float    BALL_SPEED       = 100.0f;         //< Pixels per second
+constexpr float    MIN_BALL_WEIGHT  = 0.05f;          //< Keeps the mass above 0
+constexpr float    STEP_DT          = 1.0f / 120.0f; //< Fixed timestep
+constexpr float    MAX_FRAME_TIME   = 0.25f;          //< Longest frame to redo
+constexpr size_t   VELOCITY_ITERS   = 8;     //< Impulse passes over contacts
+constexpr size_t   POSITION_ITERS   = 3;     //< Overlap passes over contacts
+constexpr float    RESTITUTION      = 1.0f;  //< Bounciness of the balls
+constexpr float    BOUNCE_SPEED     = 10.0f; //< Slowest approach that bounces
+constexpr float    CONTACT_SLOP     = 0.05f; //< Overlap left alone, in pixels
+constexpr float    BAUMGARTE        = 0.8f;  //< Share of overlap fixed a pass
+constexpr size_t   ISLAND_GRAIN     = 16;    //< Islands per thread pool chunk
+constexpr double   ENERGY_TOLERANCE = 1e-4;  //< Rounding, relative, headless
 
 // Globals
 // ***********************************************************************
 
 std::vector<class Ball> gBalls;
-std::function<float()>  rnd;
+Random                  rnd;
+
+/**
+ * What happened in a collision between two balls.
+ */
+struct CollisionEvent {
+	sf::Vector2f N;   //< Collision normal
+	float        v1N; //< Normal velocity of the first ball before
+	float        v2N; //< Normal velocity of the second ball before
+	sf::Vector2f u1;  //< Velocity of the first ball after
+	sf::Vector2f u2;  //< Velocity of the second ball after
+};
+
+#ifdef MFP_TRACE
+/// The most recent collisions, see dumpTrace()
+TraceRing<CollisionEvent, 4096> gCollisionTrace;
+#endif
 
 // Declarations
 // ***********************************************************************
@@ -35,6 +70,12 @@ class AABB {
 		this->max = max;
 	}
 
+	/// Is this AABB overlapping another AABB?
+	bool overlaps(const AABB &other) const {
+		return min.x <= other.max.x && other.min.x <= max.x &&
+		       min.y <= other.max.y && other.min.y <= max.y;
+	}
+
 	sf::Vector2f min;
 	sf::Vector2f max;
 };
@@ -45,27 +86,38 @@ class AABB {
 class Ball {
   public:
 	/// Construct a new ball with a given position
-	Ball(const sf::Vector2f pos, const sf::Vector2f vel) {
-		auto weight = rnd() + 1;
-		this->shape = sf::CircleShape(BALL_RADIUS * weight, BALL_POINT_COUNT);
+	Ball(const sf::Vector2f pos, const sf::Vector2f vel, const float radius) {
+		auto weight = std::max(rnd() + 1, MIN_BALL_WEIGHT);
+		this->shape = sf::CircleShape(radius * weight, BALL_POINT_COUNT);
 		this->shape.setOrigin(
 		    sf::Vector2(shape.getRadius(), shape.getRadius()));
 		this->shape.setFillColor(sf::Color::Red);
 		this->pos  = pos;
+		this->prev = pos;
 		this->vel  = vel;
 		this->mass = weight;
 	}
 
+	/// Remember where the ball was at the start of a step
+	void beginStep() { prev = pos; }
+
 	/// Update the internal state of the ball
 	void update(const float dt) {
 		// Integration
 		pos = pos + vel * dt;
-
-		shape.setPosition(pos);
 	}
 
-	/// Draw the ball
-	void draw(sf::RenderWindow &w) { w.draw(this->shape); }
+	/**
+	 * Draw the ball.
+	 *
+	 * @param w     The SFML window that does the actual drawing
+	 * @param alpha How far the render time is into the current step, the
+	 *              ball is drawn that far from the start to the end of it.
+	 */
+	void draw(sf::RenderWindow &w, const float alpha) {
+		shape.setPosition(lerp(prev, pos, alpha));
+		w.draw(this->shape);
+	}
 
 	/// Is this ball intersecting another ball?
 	bool isIntersecting(const Ball &other) {
@@ -75,6 +127,79 @@ class Ball {
 		return minD >= dis;
 	}
 
+	/**
+	 * The bounding box of the ball over a time step.
+	 *
+	 * @param dt Length of the step, the box covers everything the ball
+	 *           touches moving from where it is now.
+	 */
+	AABB getBounds(const float dt = 0.0f) const {
+		auto r   = getRadius();
+		auto end = pos + vel * dt;
+		return AABB(sf::Vector2f(std::min(pos.x, end.x) - r,
+		                         std::min(pos.y, end.y) - r),
+		            sf::Vector2f(std::max(pos.x, end.x) + r,
+		                         std::max(pos.y, end.y) + r));
+	}
+
+	/**
+	 * Time of impact with another ball.
+	 *
+	 * Solves |p + v t| = r1 + r2 for the earliest t, where p and v are the
+	 * relative position and velocity of the balls.
+	 *
+	 * @param other The other ball
+	 * @param dt    Length of the step
+	 * @return      Time into the step when the balls first touch, or a
+	 *              negative number if they don't touch during the step, or
+	 *              already intersect.
+	 */
+	float timeOfImpact(const Ball &other, const float dt) const {
+		auto p = other.pos - this->pos;
+		auto v = other.vel - this->vel;
+		auto r = this->getRadius() + other.getRadius();
+
+		auto a = dot(v, v);
+		auto b = 2.0f * dot(p, v);
+		auto c = dot(p, p) - r * r;
+
+		// Already intersecting, or moving apart
+		if (c <= 0.0f || b >= 0.0f)
+			return -1.0f;
+
+		auto disc = b * b - 4.0f * a * c;
+		if (disc < 0.0f)
+			return -1.0f;
+
+		auto t = (-b - std::sqrt(disc)) / (2.0f * a);
+		return t <= dt ? t : -1.0f;
+	}
+
+	/**
+	 * Time of impact with the inside of an AABB.
+	 *
+	 * @param other The box
+	 * @param dt    Length of the step
+	 * @return      Time into the step when the ball first touches a side, or
+	 *              a negative number if it doesn't during the step.
+	 */
+	float timeOfImpact(const AABB &other, const float dt) const {
+		auto rad = getRadius();
+		auto t   = dt + 1.0f;
+
+		if (vel.x > 0.0f)
+			t = std::min(t, (other.max.x - rad - pos.x) / vel.x);
+		else if (vel.x < 0.0f)
+			t = std::min(t, (other.min.x + rad - pos.x) / vel.x);
+
+		if (vel.y > 0.0f)
+			t = std::min(t, (other.max.y - rad - pos.y) / vel.y);
+		else if (vel.y < 0.0f)
+			t = std::min(t, (other.min.y + rad - pos.y) / vel.y);
+
+		return t >= 0.0f && t <= dt ? t : -1.0f;
+	}
+
 	/// Is this ball intersecting another AABB?
 	// FIXME: Do I even need this?
 	//	bool isIntersecting(const AABB &other) {
@@ -83,48 +208,45 @@ class Ball {
 	//		return false;
 	//	}
 
+	/// Bounce off the sides of an AABB the ball is touching and moving into
+	void bounce(const AABB &other) {
+		// Allow for rounding, this is called when the ball just got there
+		auto rad = shape.getRadius() * 1.001f;
+
+		if ((pos.x >= other.max.x - rad && vel.x > 0.0f) ||
+		    (pos.x <= other.min.x + rad && vel.x < 0.0f))
+			vel.x = -vel.x;
+
+		if ((pos.y >= other.max.y - rad && vel.y > 0.0f) ||
+		    (pos.y <= other.min.y + rad && vel.y < 0.0f))
+			vel.y = -vel.y;
+	}
+
 	/// Perform collision between Ball and AABB if intersecting
-	void collide(AABB &other) {
+	void collide(const AABB &other) {
 		auto rad = shape.getRadius();
 
+		// Only turn around balls heading into the wall, one that already
+		// bounced off it might still be touching it
 		if (pos.x >= other.max.x - rad) {
 			pos.x = other.max.x - rad;
-			vel.x = -vel.x;
+			vel.x = -std::abs(vel.x);
 		} else if (pos.x <= other.min.x + rad) {
 			pos.x = other.min.x + rad;
-			vel.x = -vel.x;
+			vel.x = std::abs(vel.x);
 		}
 
 		if (pos.y >= other.max.y - rad) {
 			pos.y = other.max.y - rad;
-			vel.y = -vel.y;
+			vel.y = -std::abs(vel.y);
 		} else if (pos.y <= other.min.y + rad) {
 			pos.y = other.min.y + rad;
-			vel.y = -vel.y;
+			vel.y = std::abs(vel.y);
 		}
-
-		shape.setPosition(pos);
 	}
 
-	/// Perform collision between two balls if intersecting
-	void collide(Ball &other) {
-		if (!isIntersecting(other))
-			return;
-
-		// Move objects out of collision
-		// FIXME: Moving out of one object might move you into another, causing
-		// weird bugs
-		// *******************************************************************
-		auto d = (other.getRadius() + this->getRadius() -
-		          length(other.pos - this->pos)) /
-		         2.0f;
-
-		auto dir_other = d * other.vel / length(other.vel);
-		auto dir_this  = d * this->vel / length(this->vel);
-
-		other.pos -= dir_other;
-		this->pos -= dir_this;
-
+	/// Exchange momentum with a ball that is touching this one
+	void bounce(Ball &other) {
 		// 2D -> 1D
 		// *******************************************************************
 		auto m1 = this->mass;
@@ -134,15 +256,12 @@ class Ball {
 
 		auto N = (this->pos - other.pos) / length(this->pos - other.pos);
 		auto T = sf::Vector2f(-N.y, N.x);
-		std::cout << "N: " << N << std::endl;
 
 		auto v1N = dot(v1, N);
 		auto v2N = dot(v2, N);
 		auto v1T = dot(v1, T);
 		auto v2T = dot(v2, T);
 
-		std::cout << "v1N: " << v1N << "\nv2N: " << v2N << std::endl;
-
 		// Collide
 		// *******************************************************************
 		auto u1N =
@@ -155,38 +274,763 @@ class Ball {
 		auto u1 = u1N * N + v1T * T;
 		auto u2 = u2N * N + v2T * T;
 
-		std::cout << "u1: " << u1 << " u2: " << u2 << std::endl;
+		TRACE(gCollisionTrace, CollisionEvent{N, v1N, v2N, u1, u2});
 
 		this->vel = u1;
 		other.vel = u2;
 	}
 
+	/// Change the velocity by an impulse
+	void applyImpulse(const sf::Vector2f impulse) { vel += impulse / mass; }
+
+	/// Move the ball directly, without changing its velocity
+	void translate(const sf::Vector2f offset) { pos += offset; }
+
 	void setPosition(const sf::Vector2f pos) {
-		this->pos = pos;
-		shape.setPosition(pos);
+		this->pos  = pos;
+		this->prev = pos;
 	}
 
-	float getRadius() const { return shape.getRadius(); }
+	sf::Vector2f getPosition() const { return pos; }
+	sf::Vector2f getVelocity() const { return vel; }
+	float        getRadius() const { return shape.getRadius(); }
+	float        getInverseMass() const { return 1.0f / mass; }
 
   private:
 	sf::CircleShape shape;
 	sf::Vector2f    pos;
+	sf::Vector2f    prev; //< Position at the start of the step
 	sf::Vector2f    vel;
 	float           mass;
 };
 
 /**
- * Main entry point.
- * @return EXIT_SUCCESS
+ * Sweep and prune broad phase.
+ *
+ * Finds the pairs of balls with overlapping bounding boxes, so that the
+ * narrow phase only runs on balls that can actually be colliding. The boxes
+ * are sorted along the x axis, and each box is only tested against the boxes
+ * that start before it ends, which is O(N log N) for evenly spread balls
+ * rather than O(N^2).
+ *
+ * @see [Sweep and prune](https://en.wikipedia.org/wiki/Sweep_and_prune)
  */
-int main() {
-	// Init randomness
-	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	rnd = std::bind(distribution, generator);
+class BroadPhase {
+  public:
+	using Pair = std::pair<uint32_t, uint32_t>;
+
+	const std::vector<Pair> &findPairs(const std::vector<Ball> &balls,
+	                                   float                    dt = 0.0f);
+
+  private:
+	/// Where a box starts along the sweep axis
+	struct Endpoint {
+		float    min;
+		uint32_t index;
+	};
+
+	std::vector<AABB>     bounds;
+	std::vector<Endpoint> endpoints;
+	std::vector<Pair>     pairs;
+};
+
+/**
+ * Find the candidate pairs of colliding balls.
+ *
+ * @param balls All the balls
+ * @param dt    Length of the step the boxes should cover, 0 to only find
+ *              the balls that are already touching.
+ * @return      The pairs of indices (i, j), with i < j, of balls with
+ *              overlapping bounding boxes, sorted by i then j.
+ */
+const std::vector<BroadPhase::Pair> &
+BroadPhase::findPairs(const std::vector<Ball> &balls, const float dt) {
+	bounds.clear();
+	endpoints.clear();
+	pairs.clear();
+
+	for (size_t i = 0; i < balls.size(); i++) {
+		bounds.push_back(balls[i].getBounds(dt));
+		endpoints.push_back({bounds.back().min.x, static_cast<uint32_t>(i)});
+	}
+
+	std::sort(endpoints.begin(), endpoints.end(),
+	          [](const Endpoint &a, const Endpoint &b) {
+		          return a.min < b.min || (a.min == b.min && a.index < b.index);
+	          });
+
+	// Sweep along x, every box that starts before the current one ends is
+	// overlapping it along x
+	for (size_t i = 0; i < endpoints.size(); i++) {
+		auto  a   = endpoints[i].index;
+		auto &box = bounds[a];
+
+		for (size_t j = i + 1;
+		     j < endpoints.size() && endpoints[j].min <= box.max.x; j++) {
+			auto b = endpoints[j].index;
+			if (box.overlaps(bounds[b]))
+				pairs.emplace_back(std::min(a, b), std::max(a, b));
+		}
+	}
+
+	// Resolve collisions in the same order as testing every pair would
+	std::sort(pairs.begin(), pairs.end());
+
+	return pairs;
+}
+
+/**
+ * Sequential impulse contact solver.
+ *
+ * Resolves all the touching balls together rather than one pair at a time,
+ * so pushing a ball out of one neighbour can't push it into another. Each
+ * contact gets an impulse along its normal, refined over a few passes until
+ * the contacts agree with each other, and clamped so contacts only ever push.
+ * Then what is left of the overlap is removed by moving the balls apart in a
+ * few more passes, the lighter ball moving further. Moving them never changes
+ * their velocities, and only contacts can lose energy, so clusters settle.
+ *
+ * The contacts are split into islands, groups of balls touching each other
+ * directly or through other balls. Islands share no balls, so they are solved
+ * in parallel. The contacts within an island are always solved in the same
+ * order, so the result does not depend on the number of threads.
+ *
+ * @see [Iterative Dynamics with Temporal
+ * Coherence](https://box2d.org/files/ErinCatto_IterativeDynamics_GDC2005.pdf)
+ */
+class ContactSolver {
+  public:
+	using Pair = BroadPhase::Pair;
+
+	void solve(std::vector<Ball> &balls, const std::vector<Pair> &pairs,
+	           ThreadPool &pool);
+
+  private:
+	static constexpr uint32_t NONE = UINT32_MAX; //< Ball not in an island
+
+	/// Two touching balls
+	struct Contact {
+		uint32_t     a;
+		uint32_t     b;
+		sf::Vector2f N;       //< Normal from a to b
+		float        v1N;     //< Normal velocity of a before
+		float        v2N;     //< Normal velocity of b before
+		float        target;  //< Relative normal velocity to end up with
+		float        mass;    //< Effective mass along the normal
+		float        impulse; //< Normal impulse applied so far
+	};
+
+	uint32_t find(uint32_t ball);
+	void     solveIsland(std::vector<Ball> &balls, size_t island);
+
+	std::vector<Contact>  contacts;
+	std::vector<uint32_t> parent;   //< Union-find forest over the balls
+	std::vector<uint32_t> islandOf; //< Island of each root ball
+	std::vector<uint32_t> starts;   //< First slot of each island, + 1 end
+	std::vector<uint32_t> order;    //< Contact indices sorted by island
+};
+
+/**
+ * Find the root of the island a ball is in, halving the path on the way.
+ */
+uint32_t ContactSolver::find(uint32_t ball) {
+	while (parent[ball] != ball) {
+		parent[ball] = parent[parent[ball]];
+		ball         = parent[ball];
+	}
+	return ball;
+}
+
+/**
+ * Resolve the contacts between all the touching balls.
+ *
+ * @param balls All the balls
+ * @param pairs Pairs of balls that might be touching, see
+ *              BroadPhase::findPairs()
+ * @param pool  The threads to split the islands between
+ */
+void ContactSolver::solve(std::vector<Ball>       &balls,
+                          const std::vector<Pair> &pairs, ThreadPool &pool) {
+	contacts.clear();
+	parent.resize(balls.size());
+	for (size_t i = 0; i < balls.size(); i++)
+		parent[i] = static_cast<uint32_t>(i);
+
+	// Find the contacts, and join the islands of the balls they touch
+	for (auto &pair : pairs) {
+		auto &a = balls[pair.first];
+		auto &b = balls[pair.second];
+
+		auto d    = b.getPosition() - a.getPosition();
+		auto dist = length(d);
+		if (dist >= a.getRadius() + b.getRadius())
+			continue;
+
+		Contact c;
+		c.a       = pair.first;
+		c.b       = pair.second;
+		c.N       = dist > 0.0f ? d / dist : sf::Vector2f(1.0f, 0.0f);
+		c.v1N     = dot(a.getVelocity(), c.N);
+		c.v2N     = dot(b.getVelocity(), c.N);
+		c.mass    = 1.0f / (a.getInverseMass() + b.getInverseMass());
+		c.impulse = 0.0f;
+		c.target  = 0.0f; // See solveIsland()
+
+		contacts.push_back(c);
+		parent[find(c.a)] = find(c.b);
+	}
+
+	// Number the islands in the order their first contact was found, and
+	// counting sort the contacts by island
+	islandOf.assign(balls.size(), NONE);
+	starts.assign(1, 0);
+	for (auto &c : contacts) {
+		auto root = find(c.a);
+		if (islandOf[root] == NONE) {
+			islandOf[root] = static_cast<uint32_t>(starts.size() - 1);
+			starts.push_back(0);
+		}
+		starts[islandOf[root] + 1]++;
+	}
+
+	auto islands = starts.size() - 1;
+	for (size_t i = 0; i < islands; i++)
+		starts[i + 1] += starts[i];
+
+	order.resize(contacts.size());
+	for (size_t i = 0; i < contacts.size(); i++)
+		order[starts[islandOf[find(contacts[i].a)]]++] =
+		    static_cast<uint32_t>(i);
+
+	for (size_t i = islands; i-- > 0;)
+		starts[i + 1] = starts[i];
+	starts[0] = 0;
+
+	pool.parallelFor(islands, ISLAND_GRAIN, [&](size_t begin, size_t end) {
+		for (auto island = begin; island < end; island++)
+			solveIsland(balls, island);
+	});
+}
+
+/**
+ * Resolve the contacts of one island.
+ */
+void ContactSolver::solveIsland(std::vector<Ball> &balls,
+                                const size_t       island) {
+	auto begin = order.begin() + starts[island];
+	auto end   = order.begin() + starts[island + 1];
+
+	// Only two balls touching just each other bounce, when approaching fast.
+	// A single elastic impulse keeps the energy, and leaves them separating.
+	// In a cluster the contacts stay touching after the position pass, and
+	// the impulses of the contacts push on each other, so bouncing them
+	// would add energy every step. Those are only stopped from approaching,
+	// and settle. Fast impacts are bounced by ContinuousCollision anyway,
+	// when the balls first touch.
+	if (end - begin == 1) {
+		auto &c  = contacts[*begin];
+		auto  vN = c.v2N - c.v1N;
+		if (vN < -BOUNCE_SPEED)
+			c.target = -RESTITUTION * vN;
+	}
+
+	// Velocities, push the balls apart until all the contacts are happy
+	for (size_t iter = 0; iter < VELOCITY_ITERS; iter++) {
+		for (auto k = begin; k != end; k++) {
+			auto &c = contacts[*k];
+			auto &a = balls[c.a];
+			auto &b = balls[c.b];
+
+			auto vN = dot(b.getVelocity() - a.getVelocity(), c.N);
+
+			// Accumulate the impulse, and clamp the total rather than each
+			// pass, so a later pass can take back too much push
+			auto total = std::max(c.impulse + c.mass * (c.target - vN), 0.0f);
+			auto delta = total - c.impulse;
+			c.impulse  = total;
+
+			a.applyImpulse(-delta * c.N);
+			b.applyImpulse(delta * c.N);
+		}
+	}
+
+	// Positions, move the balls out of each other
+	for (size_t iter = 0; iter < POSITION_ITERS; iter++) {
+		for (auto k = begin; k != end; k++) {
+			auto &c = contacts[*k];
+			auto &a = balls[c.a];
+			auto &b = balls[c.b];
+
+			auto d     = b.getPosition() - a.getPosition();
+			auto dist  = length(d);
+			auto depth = a.getRadius() + b.getRadius() - dist;
+			if (depth <= CONTACT_SLOP)
+				continue;
+
+			auto N    = dist > 0.0f ? d / dist : c.N;
+			auto push = BAUMGARTE * (depth - CONTACT_SLOP) * c.mass * N;
+
+			a.translate(-push * a.getInverseMass());
+			b.translate(push * b.getInverseMass());
+		}
+	}
+
+#ifdef MFP_TRACE
+	for (auto k = begin; k != end; k++) {
+		auto &c = contacts[*k];
+		TRACE(gCollisionTrace,
+		      CollisionEvent{c.N, c.v1N, c.v2N, balls[c.a].getVelocity(),
+		                     balls[c.b].getVelocity()});
+	}
+#endif
+}
+
+/**
+ * Continuous collision detection.
+ *
+ * A ball moving further than its own radius in a step can pass straight
+ * through a wall or another ball without ever intersecting it at the end of
+ * a step. So rather than moving every ball by the whole step, advance()
+ * finds the time each ball first hits something during the step, and stops
+ * it there to bounce before moving it for the rest of the step.
+ *
+ * Only the first hit of each ball in a step is resolved, except that a ball
+ * keeps bouncing off the walls for the rest of the step, so it never leaves
+ * the table. Any other ball it runs into after that is left to the next
+ * step.
+ */
+class ContinuousCollision {
+  public:
+	using Pair = BroadPhase::Pair;
+
+	void advance(std::vector<Ball> &balls, const std::vector<Pair> &pairs,
+	             const AABB &screen, float dt);
+
+  private:
+	static constexpr uint32_t WALL             = UINT32_MAX; //< Not a ball
+	static constexpr size_t   MAX_WALL_BOUNCES = 8;          //< In a move()
+
+	static void move(Ball &ball, const AABB &screen, float dt);
+
+	/// A ball (or two) hitting something t into the step
+	struct Impact {
+		float    t;
+		uint32_t a;
+		uint32_t b; //< The other ball, or WALL
+	};
+
+	std::vector<Impact> impacts;
+	std::vector<bool>   resolved; //< Has the ball hit something this step?
+};
+
+/**
+ * Move all the balls by a step, bouncing them off the first thing they hit
+ * on the way.
+ *
+ * @param balls  All the balls
+ * @param pairs  Pairs of balls whose boxes overlap over the step, see
+ *               BroadPhase::findPairs()
+ * @param screen The walls of the table
+ * @param dt     Length of the step
+ */
+void ContinuousCollision::advance(std::vector<Ball>       &balls,
+                                  const std::vector<Pair> &pairs,
+                                  const AABB &screen, const float dt) {
+	impacts.clear();
+	resolved.assign(balls.size(), false);
+
+	for (size_t i = 0; i < balls.size(); i++) {
+		auto t = balls[i].timeOfImpact(screen, dt);
+		if (t >= 0.0f)
+			impacts.push_back({t, static_cast<uint32_t>(i), WALL});
+	}
+
+	for (auto &pair : pairs) {
+		auto t = balls[pair.first].timeOfImpact(balls[pair.second], dt);
+		if (t >= 0.0f)
+			impacts.push_back({t, pair.first, pair.second});
+	}
+
+	// Earliest first, ties broken by index so the result is reproducible
+	std::sort(impacts.begin(), impacts.end(),
+	          [](const Impact &x, const Impact &y) {
+		          if (x.t != y.t)
+			          return x.t < y.t;
+		          return x.a < y.a || (x.a == y.a && x.b < y.b);
+	          });
+
+	for (auto &impact : impacts) {
+		if (resolved[impact.a] || (impact.b != WALL && resolved[impact.b]))
+			continue;
 
+		auto &a = balls[impact.a];
+		a.update(impact.t);
+		resolved[impact.a] = true;
+
+		if (impact.b == WALL) {
+			a.bounce(screen);
+			move(a, screen, dt - impact.t);
+			continue;
+		}
+
+		auto &b = balls[impact.b];
+		b.update(impact.t);
+		resolved[impact.b] = true;
+
+		a.bounce(b);
+		move(a, screen, dt - impact.t);
+		move(b, screen, dt - impact.t);
+	}
+
+	for (size_t i = 0; i < balls.size(); i++)
+		if (!resolved[i])
+			balls[i].update(dt);
+}
+
+/**
+ * Move a ball by dt, bouncing it off every wall on the way, like the two
+ * walls of a corner.
+ */
+void ContinuousCollision::move(Ball &ball, const AABB &screen, float dt) {
+	for (size_t i = 0; i < MAX_WALL_BOUNCES; i++) {
+		auto t = ball.timeOfImpact(screen, dt);
+		if (t < 0.0f) {
+			ball.update(dt);
+			return;
+		}
+
+		ball.update(t);
+		ball.bounce(screen);
+		dt -= t;
+	}
+
+	// Out of bounces, which takes a ball fast enough to cross the table
+	// several times in a step. Just put it back on the table.
+	ball.update(dt);
+	ball.collide(screen);
+}
+
+// Simulation
+// ***********************************************************************
+
+/**
+ * Spawn balls spread out across the screen without intersections.
+ *
+ * @param count Number of balls
+ * @param speed Largest speed along each axis
+ */
+void spawnBalls(const size_t count, const float speed) {
+	// Split the screen into at least one cell per ball, and shrink the balls
+	// until the largest possible ball fits in a cell
+	auto columns =
+	    std::max(static_cast<size_t>(std::ceil(std::sqrt(count))), size_t(1));
+	auto cell   = sf::Vector2f(WINDOWX, WINDOWY) / (float)columns;
+	auto radius = std::min(BALL_RADIUS, std::min(cell.x, cell.y) / 4.0f);
+
+	// Spawn all the balls
+	gBalls.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		auto pos = sf::Vector2f(WINDOWX / 2, WINDOWY / 2);
+
+		float rand = rnd();
+		auto  vel  = speed * sf::Vector2f(rand, 1.0f - rand);
+
+		auto ball = Ball(pos, vel, radius);
+		gBalls.push_back(ball);
+	}
+
+	// Distribute the balls around the screen without intersections, by
+	// placing each ball somewhere inside its own random cell
+	std::vector<size_t> cells(columns * columns);
+	for (size_t i = 0; i < cells.size(); i++) {
+		auto j   = std::min(i, (size_t)((rnd() + 1.0f) / 2.0f * (i + 1)));
+		cells[i] = cells[j];
+		cells[j] = i;
+	}
+
+	for (size_t i = 0; i < gBalls.size(); i++) {
+		auto corner = sf::Vector2f(cells[i] % columns * cell.x,
+		                           cells[i] / columns * cell.y);
+		auto slack  = cell / 2.0f - sf::Vector2f(2.0f * radius, 2.0f * radius);
+		auto offset = sf::Vector2f(rnd() * slack.x, rnd() * slack.y);
+
+		gBalls[i].setPosition(corner + cell / 2.0f + offset);
+	}
+}
+
+/**
+ * Spawn balls packed into a square rack in the middle of the table, touching
+ * and overlapping their neighbours, as the heavier balls are larger.
+ *
+ * @param count Number of balls
+ * @param speed Largest speed along each axis
+ */
+void spawnRack(const size_t count, const float speed) {
+	auto columns =
+	    std::max(static_cast<size_t>(std::ceil(std::sqrt(count))), size_t(1));
+	auto spacing = std::min(2.0f * BALL_RADIUS, WINDOWX / (columns + 2.0f));
+	auto corner  = sf::Vector2f(WINDOWX, WINDOWY) / 2.0f -
+	              sf::Vector2f(1.0f, 1.0f) * spacing * (columns - 1.0f) / 2.0f;
+
+	gBalls.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		auto pos = corner + sf::Vector2f(i % columns, i / columns) * spacing;
+		auto vel = speed * sf::Vector2f(rnd(), rnd());
+		gBalls.emplace_back(pos, vel, spacing / 2.0f);
+	}
+}
+
+/**
+ * Everything a step works with besides the balls. Kept between steps, so the
+ * scratch buffers are allocated once.
+ */
+struct World {
+	AABB                screen;     //< The walls of the table
+	BroadPhase          broadPhase; //< Finds the pairs of balls to test
+	ContactSolver       solver;     //< Pushes touching balls apart
+	ContinuousCollision ccd;        //< Moves balls without tunneling
+	ThreadPool         &pool;       //< Threads to split the work between
+};
+
+/**
+ * Advance the simulation by one fixed step.
+ *
+ * @param dt       Length of the step
+ * @param substeps Number of collision and integration passes in the step
+ * @param world    The table, and the collision passes
+ */
+void step(const float dt, const size_t substeps, World &world) {
+	for (auto &ball : gBalls)
+		ball.beginStep();
+
+	auto h = dt / (float)substeps;
+	for (size_t s = 0; s < substeps; s++) {
+		// Collisions, the boxes cover the whole substep so the pairs include
+		// the balls that will only touch on the way
+		world.solver.solve(gBalls, world.broadPhase.findPairs(gBalls, h),
+		                   world.pool);
+
+		// Collide with the walls last, so balls pushed apart above are
+		// put back on the table before they move
+		for (auto &ball : gBalls)
+			ball.collide(world.screen);
+
+		// Move, stopping at the first hit on the way. The solver and the
+		// walls changed velocities, so the boxes are swept again along the
+		// paths the balls will actually take.
+		world.ccd.advance(gBalls, world.broadPhase.findPairs(gBalls, h),
+		                  world.screen, h);
+	}
+}
+
+/**
+ * FNV-1a hash of the exact bits of every position and velocity. Two runs only
+ * have the same checksum if they ended in the same state.
+ */
+uint64_t checksum() {
+	uint64_t hash = 14695981039346656037ull;
+	for (const auto &ball : gBalls) {
+		auto  pos      = ball.getPosition();
+		auto  vel      = ball.getVelocity();
+		float state[4] = {pos.x, pos.y, vel.x, vel.y};
+
+		unsigned char bytes[sizeof(state)];
+		std::memcpy(bytes, state, sizeof(state));
+		for (auto b : bytes) {
+			hash ^= b;
+			hash *= 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+/**
+ * Print the collisions recorded in the trace buffer, if tracing is compiled
+ * in.
+ */
+void dumpTrace() {
+#ifdef MFP_TRACE
+	gCollisionTrace.dump([](uint64_t index, const CollisionEvent &e) {
+		std::cout << "#" << index << " N: " << e.N << " v1N: " << e.v1N
+		          << " v2N: " << e.v2N << " u1: " << e.u1 << " u2: " << e.u2
+		          << '\n';
+	});
+	std::cout << gCollisionTrace.pushed() << " collisions recorded"
+	          << std::endl;
+#else
+	std::cout << "Tracing is disabled, build with ENABLE_TRACE" << std::endl;
+#endif
+}
+
+// Main
+// ***********************************************************************
+
+/**
+ * Command line options.
+ */
+struct Options {
+	bool     headless = false;      //< Run without a window
+	bool     rack     = false;      //< Pack the balls in a rack
+	size_t   balls    = BALL_COUNT; //< Number of balls
+	float    speed    = BALL_SPEED; //< Speed the balls start with
+	size_t   steps    = 1000;       //< Steps to run when headless
+	float    dt       = STEP_DT;    //< Length of a fixed step
+	size_t   substeps = 1;          //< Passes per fixed step
+	uint32_t seed     = 0;          //< Seed for the balls
+	bool     seeded   = false;      //< Was a seed given?
+	bool     trace    = false;      //< Dump the trace after a headless run
+	size_t   threads  = std::thread::hardware_concurrency();
+};
+
+/**
+ * Parse the command line, exits with a usage message on bad input.
+ */
+Options parseOptions(int argc, char **argv) {
+	Options opts;
+
+	auto usage = [&]() {
+		std::cout << "Usage: " << argv[0]
+		          << " [--headless] [--trace] [--rack] [--balls N]"
+		             " [--speed PIXELS] [--steps N] [--dt SECONDS]"
+		             " [--substeps N] [--seed N] [--threads N]\n";
+		exit(EXIT_FAILURE);
+	};
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--headless") {
+			opts.headless = true;
+			continue;
+		} else if (arg == "--trace") {
+			opts.trace = true;
+			continue;
+		} else if (arg == "--rack") {
+			opts.rack = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			usage();
+
+		try {
+			std::string value = argv[++i];
+			if (arg == "--balls")
+				opts.balls = std::stoul(value);
+			else if (arg == "--speed")
+				opts.speed = std::stof(value);
+			else if (arg == "--steps")
+				opts.steps = std::stoul(value);
+			else if (arg == "--dt")
+				opts.dt = std::stof(value);
+			else if (arg == "--substeps")
+				opts.substeps = std::stoul(value);
+			else if (arg == "--threads")
+				opts.threads = std::stoul(value);
+			else if (arg == "--seed") {
+				opts.seed   = std::stoul(value);
+				opts.seeded = true;
+			} else
+				usage();
+		} catch (const std::logic_error &) {
+			usage();
+		}
+	}
+
+	if (opts.dt <= 0.0f || opts.substeps == 0)
+		usage();
+
+	return opts;
+}
+
+/**
+ * Kinetic energy of all the balls.
+ */
+double kineticEnergy() {
+	double energy = 0.0;
+	for (const auto &ball : gBalls) {
+		auto vel = ball.getVelocity();
+		energy += 0.5 * dot(vel, vel) / ball.getInverseMass();
+	}
+	return energy;
+}
+
+/**
+ * Count the balls that are not entirely on the table.
+ *
+ * @param screen The walls of the table
+ */
+size_t countOffTable(const AABB &screen) {
+	// Allow for rounding, balls are stopped right at the walls
+	constexpr float EPSILON = 0.01f;
+
+	size_t off = 0;
+	for (const auto &ball : gBalls) {
+		auto pos = ball.getPosition();
+		auto rad = ball.getRadius() - EPSILON;
+		off += pos.x - rad < screen.min.x || pos.x + rad > screen.max.x ||
+		       pos.y - rad < screen.min.y || pos.y + rad > screen.max.y ||
+		       !std::isfinite(pos.x) || !std::isfinite(pos.y);
+	}
+	return off;
+}
+
+/**
+ * Run a fixed number of steps without a window, and report the throughput
+ * and the state the balls ended up in.
+ *
+ * @return EXIT_SUCCESS if every ball stayed on the table.
+ */
+int runHeadless(const Options &opts, ThreadPool &pool) {
+	auto screen =
+	    AABB(sf::Vector2f(0.0f, 0.0f), sf::Vector2f(WINDOWX, WINDOWY));
+	World world{screen, {}, {}, {}, pool};
+
+	size_t escapes = 0; // Steps that ended with balls off the table
+	size_t gains   = 0; // Steps that added kinetic energy
+	auto   initial = kineticEnergy();
+	auto   energy  = initial;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < opts.steps; i++) {
+		step(opts.dt, opts.substeps, world);
+		escapes += countOffTable(screen) > 0;
+
+		// Collisions only trade energy between the balls, or lose some
+		auto next = kineticEnergy();
+		gains += !(next <= energy * (1.0 + ENERGY_TOLERANCE));
+		energy = next;
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::cout << "balls: " << opts.balls << " steps: " << opts.steps
+	          << " dt: " << opts.dt << " substeps: " << opts.substeps
+	          << " seed: " << opts.seed << " threads: " << pool.size()
+	          << "\ntime: " << seconds
+	          << " s steps/s: " << opts.steps / seconds
+	          << " ball steps/s: " << opts.steps * opts.balls / seconds
+	          << "\nchecksum: " << std::hex << std::setfill('0')
+	          << std::setw(16) << checksum() << std::dec
+	          << "\nkinetic energy: " << initial << " -> " << energy
+	          << "\nsteps with balls off the table: " << escapes
+	          << "\nsteps that added energy: " << gains << "\n"
+	          << (escapes == 0 && gains == 0 ? "ok" : "FAILED") << std::endl;
+
+	if (opts.trace)
+		dumpTrace();
+
+	return escapes == 0 && gains == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Run the simulation in a window, in real time.
+ *
+ * The simulation always advances in fixed steps, however long a frame takes.
+ * Frames draw the balls interpolated between the last two steps.
+ *
+ * @see [Fix Your Timestep!](https://gafferongames.com/post/fix_your_timestep/)
+ */
+int runWindowed(const Options &opts, ThreadPool &pool) {
 	// Init sfml stuff
 	// *******************************************************************
 
@@ -206,37 +1050,9 @@ int main() {
 	auto screen =
 	    AABB(sf::Vector2f(0.0f, 0.0f), sf::Vector2f(WINDOWX, WINDOWY));
 
-	// Spawn all the balls
-	gBalls.reserve(BALL_COUNT);
-	for (size_t i = 0; i < BALL_COUNT; i++) {
-		auto pos = sf::Vector2f(WINDOWX / 2, WINDOWY / 2);
+	World world{screen, {}, {}, {}, pool};
 
-		float speed = 100.0f;
-		float rand  = rnd();
-		auto  vel   = speed * sf::Vector2f(rand, 1.0f - rand);
-
-		auto ball = Ball(pos, vel);
-		gBalls.push_back(ball);
-	}
-
-	// Distribute the balls around the screen without intersections
-	for (size_t i = 0; i < gBalls.size(); i++) {
-		bool colliding;
-
-		do {
-			colliding = false;
-			gBalls[i].setPosition(sf::Vector2f((rnd() + 1) * WINDOWX / 2,
-			                                   (rnd() + 1) * WINDOWY / 2));
-			for (size_t j = 0; j < gBalls.size(); j++) {
-				if (i == j)
-					continue;
-
-				colliding = gBalls[i].isIntersecting(gBalls[j]);
-			}
-		} while (colliding);
-	}
-
-	float     time = 0.0f;
+	float     accumulator = 0.0f;
 	sf::Clock clock;
 	clock.restart();
 
@@ -250,6 +1066,11 @@ int main() {
 				case sf::Event::Closed: window.close(); break;
 
 				case sf::Event::KeyPressed:
+					if (event.key.code == sf::Keyboard::T) {
+						dumpTrace();
+						break;
+					}
+
 					capture_texture.create(windowSize.x, windowSize.y);
 					capture_texture.update(window);
 					capture = capture_texture.copyToImage();
@@ -260,26 +1081,16 @@ int main() {
 			}
 		}
 
-		float dt = clock.restart().asSeconds();
-		time += dt;
+		// Don't try to catch up on hitches longer than MAX_FRAME_TIME, or
+		// the simulation falls further behind with every frame
+		accumulator += std::min(clock.restart().asSeconds(), MAX_FRAME_TIME);
 
 		// Simulation
 		// ***************************************************************
 
-		// Collisions
-		for (auto i = 0; i < gBalls.size(); i++) {
-			// Collide with wall
-			gBalls[i].collide(screen);
-
-			// Collide with other balls
-			for (auto j = i + 1; j < gBalls.size(); j++) {
-				gBalls[i].collide(gBalls[j]);
-			}
-		}
-
-		// Normal update
-		for (auto &ball : gBalls) {
-			ball.update(dt);
+		while (accumulator >= opts.dt) {
+			step(opts.dt, opts.substeps, world);
+			accumulator -= opts.dt;
 		}
 
 		// Rendering
@@ -288,11 +1099,40 @@ int main() {
 		window.clear();
 
 		// Draw the balls
+		auto alpha = accumulator / opts.dt;
 		for (auto &ball : gBalls)
-			ball.draw(window);
+			ball.draw(window, alpha);
 
 		window.display();
 	}
 
 	return EXIT_SUCCESS;
 }
+
+/**
+ * Main entry point.
+ * @return EXIT_SUCCESS
+ */
+int main(int argc, char **argv) {
+	auto opts = parseOptions(argc, argv);
+
+	// Init randomness
+	// *******************************************************************
+	if (!opts.seeded) {
+		std::random_device rd;
+		opts.seed = rd();
+	}
+	rnd = Random(opts.seed);
+
+	if (opts.rack)
+		spawnRack(opts.balls, opts.speed);
+	else
+		spawnBalls(opts.balls, opts.speed);
+
+	ThreadPool pool(opts.threads);
+
+	if (opts.headless)
+		return runHeadless(opts, pool);
+	else
+		return runWindowed(opts, pool);
+}
@@ -9,6 +9,13 @@
  */
 
 #include "common.h"
+#include "random.h"
+#include "simd.h"
+#include "spatial_hash.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstring>
 
 // Constants
 // ***********************************************************************
@@ -16,55 +23,85 @@
 constexpr uint32_t WINDOWX     = 1000;
 constexpr uint32_t WINDOWY     = 1000;
 constexpr uint32_t NUM_OBJECTS = 100;
-constexpr float    MAX_ANGLE   = 6.0f * M_PI_4;
+constexpr float    MAX_ANGLE   = 6.0f * M_PI_4; //< Width of the field of view
+constexpr size_t   GRAIN       = 256;           //< Boids per chunk of work
 
-// Globals
-// ***********************************************************************
+constexpr float MAX_SPEED       = 80.0f;  //< Max speed of a boid
+constexpr float MAX_FORCE       = 1.0f;   //< Max force to apply per rule
+constexpr float COHESION_DIST   = 200.0f; //< Max cohesion distance
+constexpr float SEPARATION_DIST = 80.0f;  //< Max separation distance
+constexpr float ALIGNMENT_DIST  = 220.0f; //< Max alignment distance
+constexpr float FLEE_DIST       = 300.0f; //< Max flee distance
 
-std::vector<class Boid *>     gBoids;
-std::vector<class Predator *> gPredators;
-std::function<float()>        rnd;
-
-// class declarations
+// Class declarations
 // ***********************************************************************
 
-class Boid {
-  public:
-	Boid();
-	virtual ~Boid() = default;
-	virtual void update(float dt);
-	void         draw(sf::RenderWindow &w);
-	sf::Vector2f getPosition() const;
-	sf::Vector2f getVelocity() const;
-
-  protected:
-	sf::Vector2f computeCohesion();
-	sf::Vector2f computeSeparation();
-	sf::Vector2f computeAlignment();
-	sf::Vector2f computeFlee();
-	sf::Vector2f steer(sf::Vector2f dir, float steerforce);
-
-	static constexpr float maxspeed     = 80.0f; //< Max speed of the boid
-	static constexpr float maxforce     = 1.0f;  //< Max force to apply per rule
-	static constexpr float cohesiondist = 200.0f;   //< Max cohesion distance
-	static constexpr float separationdist = 80.0f;  //< Max separation distance
-	static constexpr float alignmentdist  = 220.0f; //< Max alignment distance
-	static constexpr float fleedist       = 300.0f; //< Max flee distance
-
-	sf::Vector2f    pos;
-	sf::Vector2f    vel;
-	sf::CircleShape shape;
-};
-
 /**
- * A Predator that chases boids, but never catches them.
+ * A flock of boids, stored as a structure of arrays.
+ *
+ * The arrays only hold what the simulation reads, so the neighbour loops
+ * stream through contiguous memory. Rendering state lives with the renderer.
+ * Every array is padded with one simd::Float worth of elements, so kernels
+ * can load a full vector at the end of a range.
+ *
+ * The state is double buffered. step() reads frame N from cur and writes
+ * frame N + 1 to next, so the result does not depend on the order the boids
+ * are updated in, and the boids can be updated in parallel.
  */
-class Predator : public Boid {
+class Flock {
   public:
-	Predator();
-	void update(float dt) override;
+	Flock(float radius, float cohesion, float separation, float alignment,
+	      float flee);
+
+	void   add(sf::Vector2f pos, sf::Vector2f vel);
+	void   sort(const SpatialHash &grid, ThreadPool &pool);
+	void   step(float dt, ThreadPool &pool);
+	void   swap() { std::swap(cur, next); }
+	size_t size() const { return count; }
+
+	sf::Vector2f getPosition(size_t i) const {
+		return {cur.px[i], cur.py[i]};
+	}
+	sf::Vector2f getVelocity(size_t i) const {
+		return {cur.vx[i], cur.vy[i]};
+	}
+
+	const float radius; //< Size of a boid, used for wrapping around the screen
+
+  private:
+	sf::Vector2f computeSteering(size_t i) const;
+	sf::Vector2f steer(size_t i, sf::Vector2f dir, float steerforce) const;
+
+	// The weight of each rule
+	float cohesion;
+	float separation;
+	float alignment;
+	float flee;
+
+	/// One frame of flock state
+	struct State {
+		std::vector<float> px, py;
+		std::vector<float> vx, vy;
+	};
+
+	size_t count = 0;
+	State  cur;  //< Frame N, read by everyone during a step
+	State  next; //< Frame N + 1, written by step
 };
 
+// Globals
+// ***********************************************************************
+
+/// The cells are as large as the largest rule distance, so every neighbour
+/// query touches at most 3x3 cells.
+SpatialHash            gGrid(ALIGNMENT_DIST);
+Flock                  gBoids(10.0f, 1.75f, 6.0f, 0.25f, 10.0f);
+Flock                  gPredators(20.0f, 2.0f, 0.0f, 0.0f, 0.0f);
+Random                 rnd;
+
+/// A boid sees everything within MAX_ANGLE / 2 of where it is heading
+const float MAX_ANGLE_COS = std::cos(MAX_ANGLE / 2.0f);
+
 // Helper functions
 // ***********************************************************************
 
@@ -72,259 +109,462 @@ class Predator : public Boid {
  * Computes whether or not a boid is visible from another.
  * This function only considers visibility based on angle.
  *
- * @param a The first boid.
- * @param b The second boid.
- * @return  Is the boid b visible from boid a?
+ * The angle between the heading and the direction to b is within the field
+ * of view if its cosine is larger than MAX_ANGLE_COS. The cosine is the dot
+ * product of the two directions, so no trigonometry is needed.
+ *
+ * @param heading The direction boid a is moving in, normalized.
+ * @param diff    The vector from boid a to boid b.
+ * @return        Is the boid b visible from boid a?
  */
-bool visible(const Boid *a, const Boid *b) {
-	auto vel     = a->getVelocity();
-	auto a_angle = atan2(vel.y, vel.x);
-
-	auto diff    = b->getPosition() - a->getPosition();
-	auto b_angle = atan2(diff.y, diff.x);
-
-	auto angle = b_angle - a_angle;
+bool visible(const sf::Vector2f heading, const sf::Vector2f diff) {
+	return dot(heading, diff) > MAX_ANGLE_COS * length(diff);
+}
 
-	return angle < MAX_ANGLE && angle > -MAX_ANGLE;
+/**
+ * Computes whether or not a vector of boids is visible from boid a.
+ *
+ * @param hx Heading of boid a, normalized, x component.
+ * @param hy Heading of boid a, normalized, y component.
+ * @param dx The vectors from boid a to the boids, x components.
+ * @param dy The vectors from boid a to the boids, y components.
+ * @param d2 The squared lengths of the vectors.
+ * @return   Mask of the boids visible from boid a.
+ * @see visible()
+ */
+simd::Mask visible(const simd::Float hx, const simd::Float hy,
+                   const simd::Float dx, const simd::Float dy,
+                   const simd::Float d2) {
+	return hx * dx + hy * dy > simd::set1(MAX_ANGLE_COS) * simd::sqrt(d2);
 }
 
-// Boid impl
+// Flock impl
 // ***********************************************************************
 
 /**
- * Initializes the boid with a random position and velocity.
+ * Construct an empty flock.
+ *
+ * @param radius     Size of the boids
+ * @param cohesion   Weight of the cohesion rule
+ * @param separation Weight of the separation rule
+ * @param alignment  Weight of the alignment rule
+ * @param flee       Weight of the flee rule
  */
-Boid::Boid() {
-	pos        = sf::Vector2f(rnd() * WINDOWX / 2.0f, rnd() * WINDOWY / 2.0f);
-	auto angle = (rnd() + 1.0f) * M_PI;
-	vel        = sf::Vector2f(maxspeed * cos(angle), maxspeed * sin(angle));
-	shape      = sf::CircleShape(10.0f, 3);
-	shape.setPosition(pos - sf::Vector2f(shape.getRadius(), shape.getRadius()));
-	shape.setFillColor(sf::Color::Red);
-	shape.setOrigin(5.0f, 5.0f);
+Flock::Flock(const float radius, const float cohesion, const float separation,
+             const float alignment, const float flee)
+    : radius(radius), cohesion(cohesion), separation(separation),
+      alignment(alignment), flee(flee) {
+	for (auto s : {&cur, &next})
+		for (auto a : {&s->px, &s->py, &s->vx, &s->vy})
+			a->resize(simd::Float::width, 0.0f);
 }
 
 /**
- * Update the internal state of the boid.
- *
- * @param dt Delta time, time since last update.
+ * Add a boid to the flock.
  */
-void Boid::update(float dt) {
-	auto v1 = computeCohesion();
-	auto v2 = computeSeparation();
-	auto v3 = computeAlignment();
-	auto v4 = computeFlee();
-
-	auto acc = 1.75f * v1 + 6.0f * v2 + 0.25f * v3 + 10.0f * v4;
-
-	vel += acc;
-	vel = maxspeed * vel / length(vel);
-	pos += vel * dt;
-
-	// Wrap around the screen
-	if (pos.x > WINDOWX + shape.getRadius())
-		pos.x -= WINDOWX + shape.getRadius();
-	else if (pos.x < -shape.getRadius())
-		pos.x += WINDOWX + shape.getRadius();
-
-	if (pos.y > WINDOWY + shape.getRadius())
-		pos.y -= WINDOWY + shape.getRadius();
-	else if (pos.y < -shape.getRadius())
-		pos.y += WINDOWY + shape.getRadius();
+void Flock::add(const sf::Vector2f pos, const sf::Vector2f vel) {
+	cur.px.insert(cur.px.begin() + count, pos.x);
+	cur.py.insert(cur.py.begin() + count, pos.y);
+	cur.vx.insert(cur.vx.begin() + count, vel.x);
+	cur.vy.insert(cur.vy.begin() + count, vel.y);
+	count++;
+
+	for (auto a : {&next.px, &next.py, &next.vx, &next.vy})
+		a->resize(cur.px.size(), 0.0f);
 }
 
 /**
- * Draw the boid.
- *
- * @param w The SFML window that does the actual drawing
+ * Reorder the boids into the slot order of a spatial hash built over this
+ * flock. After sorting, the slot range of a bucket is also the index range of
+ * its boids, so the neighbours in a cell are contiguous in every array.
  */
-void Boid::draw(sf::RenderWindow &w) {
-	// Set the position to rotate around
-	shape.setPosition(pos);
-	// 210 was found using experimentation
-	shape.setRotation(atan2(vel.y, vel.x) / M_PI * 180.0f + 210.0f);
-
-	// Set the actual position
-	shape.setPosition(pos - sf::Vector2f(shape.getRadius(), shape.getRadius()));
-
-	w.draw(shape);
+void Flock::sort(const SpatialHash &grid, ThreadPool &pool) {
+	pool.parallelFor(count, 4 * GRAIN, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; i++) {
+			auto j     = grid.item(i);
+			next.px[i] = cur.px[j];
+			next.py[i] = cur.py[j];
+			next.vx[i] = cur.vx[j];
+			next.vy[i] = cur.vy[j];
+		}
+	});
+	swap();
 }
 
-sf::Vector2f Boid::getPosition() const { return pos; }
-
-sf::Vector2f Boid::getVelocity() const { return vel; }
+/**
+ * Compute the next frame of the flock into the back buffer. Call swap() once
+ * every flock has stepped, to make it the current frame.
+ *
+ * @param dt   Delta time, time since last update.
+ * @param pool The threads to split the boids between.
+ */
+void Flock::step(const float dt, ThreadPool &pool) {
+	pool.parallelFor(count, GRAIN, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; i++) {
+			auto acc = computeSteering(i);
+			auto vel = getVelocity(i) + acc;
+			vel      = MAX_SPEED * vel / length(vel);
+			auto pos = getPosition(i) + vel * dt;
+
+			// Wrap around the screen
+			if (pos.x > WINDOWX + radius)
+				pos.x -= WINDOWX + radius;
+			else if (pos.x < -radius)
+				pos.x += WINDOWX + radius;
+
+			if (pos.y > WINDOWY + radius)
+				pos.y -= WINDOWY + radius;
+			else if (pos.y < -radius)
+				pos.y += WINDOWY + radius;
+
+			next.px[i] = pos.x;
+			next.py[i] = pos.y;
+			next.vx[i] = vel.x;
+			next.vy[i] = vel.y;
+		}
+	});
+}
 
 /**
  * Reynolds steering function.
  *
+ * @param i   The boid to steer.
  * @param dir Desired direction.
  * @return    Direction to steer scaled to maxforce.
  *
  * @see [Steering Behaviors For Autonomous Characters]
  * (http://www.red3d.com/cwr/steer/gdc99/)
  */
-sf::Vector2f Boid::steer(const sf::Vector2f dir, float steerforce) {
-	auto ret = maxspeed * dir / length(dir) - vel;
+sf::Vector2f Flock::steer(const size_t i, const sf::Vector2f dir,
+                          float steerforce) const {
+	auto ret = MAX_SPEED * dir / length(dir) - getVelocity(i);
 	return limit(ret, steerforce);
 }
 
 /**
- * Compute the steering vector based on the cohesion rule.
+ * Compute the weighted sum of the steering vectors of all the rules.
+ *
+ * The neighbours are visited in one pass over the spatial hash of gBoids,
+ * a SIMD vector of neighbours at a time. The distance to, and visibility of,
+ * each neighbour is only computed once.
+ *
+ * @param i The boid to steer.
  */
-sf::Vector2f Boid::computeCohesion() {
-	auto   ret     = sf::Vector2f(0.0f, 0.0f);
-	size_t num_vis = 0;
-
-	for (auto other : gBoids) {
-		auto dist = length(other->getPosition() - pos);
-		if (dist > 0.0f && dist < cohesiondist && visible(this, other)) {
-			ret += other->getPosition();
-			num_vis++;
+sf::Vector2f Flock::computeSteering(const size_t i) const {
+	using namespace simd;
+
+	auto pos     = getPosition(i);
+	auto vel     = getVelocity(i);
+	auto heading = vel / length(vel);
+
+	auto x         = set1(pos.x);
+	auto y         = set1(pos.y);
+	auto hx        = set1(heading.x);
+	auto hy        = set1(heading.y);
+	auto zero      = set1(0.0f);
+	auto one       = set1(1.0f);
+	auto cohesion2 = set1(COHESION_DIST * COHESION_DIST);
+	auto separ2    = set1(SEPARATION_DIST * SEPARATION_DIST);
+	auto align2    = set1(ALIGNMENT_DIST * ALIGNMENT_DIST);
+
+	Float cx = zero, cy = zero, nc = zero; // Cohesion
+	Float sx = zero, sy = zero, ns = zero; // Separation
+	Float ax = zero, ay = zero, na = zero; // Alignment
+
+	const auto &boids = gBoids.cur;
+
+	// alignmentdist is the largest of the three rule distances
+	gGrid.queryBuckets(pos, ALIGNMENT_DIST, [&](size_t begin, size_t end) {
+		for (auto j = begin; j < end; j += Float::width) {
+			auto ox = load(&boids.px[j]);
+			auto oy = load(&boids.py[j]);
+			auto dx = ox - x;
+			auto dy = oy - y;
+			auto d2 = dx * dx + dy * dy;
+
+			auto m = firstN(end - j) & (d2 > zero) & (d2 < align2) &
+			         visible(hx, hy, dx, dy, d2);
+			if (bits(m) == 0)
+				continue;
+
+			auto mc = m & (d2 < cohesion2);
+			cx += select(mc, ox, zero);
+			cy += select(mc, oy, zero);
+			nc += select(mc, one, zero);
+
+			// FIXME: This should scale vectors based on distance. Closer boids
+			// should give greater reaction
+			auto ms = m & (d2 < separ2);
+			sx -= select(ms, dx / d2, zero);
+			sy -= select(ms, dy / d2, zero);
+			ns += select(ms, one, zero);
+
+			ax += select(m, load(&boids.vx[j]), zero);
+			ay += select(m, load(&boids.vy[j]), zero);
+			na += select(m, one, zero);
 		}
-	}
+	});
 
-	// Get the average vector
-	ret /= (float)num_vis;
+	auto fx = 0.0f, fy = 0.0f, nf = 0.0f; // Flee
+	for (size_t j = 0; j < gPredators.size(); j++) {
+		auto diff = gPredators.getPosition(j) - pos;
+		auto dist = length(diff);
+		if (dist > 0.0f && dist < FLEE_DIST && visible(heading, diff)) {
+			fx -= diff.x / dist;
+			fy -= diff.y / dist;
+			nf += 1.0f;
+		}
+	}
 
-	// Avoid dividing by zero
-	if (num_vis > 0)
-		return steer(ret, maxforce);
-	else
-		return sf::Vector2f(0.0f, 0.0f);
+	// Steer towards the average of each rule, avoid dividing by zero
+	auto acc = sf::Vector2f(0.0f, 0.0f);
+	if (reduce(nc) > 0.0f)
+		acc += cohesion * steer(i,
+		                        sf::Vector2f(reduce(cx), reduce(cy)) /
+		                            reduce(nc),
+		                        MAX_FORCE);
+	if (reduce(ns) > 0.0f)
+		acc += separation * steer(i,
+		                          sf::Vector2f(reduce(sx), reduce(sy)) /
+		                              reduce(ns),
+		                          MAX_FORCE);
+	if (reduce(na) > 0.0f)
+		acc += alignment * steer(i,
+		                         sf::Vector2f(reduce(ax), reduce(ay)) /
+		                             reduce(na),
+		                         MAX_FORCE);
+	if (nf > 0.0f)
+		acc += flee * steer(i, sf::Vector2f(fx, fy) / nf, 2.0f);
+
+	return acc;
 }
 
+// Rendering
+// ***********************************************************************
+
 /**
- * Compute the steering vector based on the separation rule.
+ * Draws flocks as triangles batched into a single vertex array.
+ *
+ * Every boid of every flock is one triangle in the same array, so a frame is
+ * one draw call however many boids there are. The array is kept between
+ * frames, and only grows when the number of boids does.
  */
-sf::Vector2f Boid::computeSeparation() {
-	auto   ret     = sf::Vector2f(0.0f, 0.0f);
-	size_t num_vis = 0;
+class FlockRenderer {
+  public:
+	void begin() { count = 0; }
+	void add(const Flock &flock, sf::Color color);
+	void draw(sf::RenderWindow &w);
 
-	for (auto other : gBoids) {
-		auto diff = pos - other->getPosition();
-		auto dist = length(diff);
-		if (dist > 0.0f && dist < separationdist && visible(this, other)) {
-			// FIXME: This should scale vectors based on distance. Closer boids
-			// should give greater reaction
-			diff /= dist;
-			diff /= dist;
-			ret += diff;
-			num_vis++;
-		}
-	}
+  private:
+	sf::VertexArray vertices{sf::Triangles};
+	size_t          count = 0; //< Vertices written this frame
+};
+
+/**
+ * Write the triangles of a flock into the vertex array.
+ *
+ * The triangles point in the direction the boids are heading, which is just
+ * the normalized velocity. So no angles or trigonometry are needed.
+ *
+ * @param flock The boids to draw
+ * @param color Color of the boids
+ */
+void FlockRenderer::add(const Flock &flock, const sf::Color color) {
+	if (vertices.getVertexCount() < count + 3 * flock.size())
+		vertices.resize(count + 3 * flock.size());
 
-	// Get the average vector
-	ret /= (float)num_vis;
+	// An equilateral triangle inscribed in a circle of the boid's radius
+	auto r    = flock.radius;
+	auto side = r * std::sqrt(3.0f) / 2.0f;
 
-	if (num_vis > 0)
-		return steer(ret, maxforce);
-	else
-		return sf::Vector2f(0.0f, 0.0f);
+	for (size_t i = 0; i < flock.size(); i++) {
+		auto pos     = flock.getPosition(i);
+		auto vel     = flock.getVelocity(i);
+		auto forward = vel / length(vel);
+		auto right   = sf::Vector2f(-forward.y, forward.x);
+
+		auto back = pos - forward * (r / 2.0f);
+
+		vertices[count++] = sf::Vertex(pos + forward * r, color);
+		vertices[count++] = sf::Vertex(back + right * side, color);
+		vertices[count++] = sf::Vertex(back - right * side, color);
+	}
 }
 
 /**
- * Compute the steering vector based on the alignment rule.
+ * Draw everything added since begin().
+ *
+ * @param w The SFML window that does the actual drawing
  */
-sf::Vector2f Boid::computeAlignment() {
-	auto   ret     = sf::Vector2f(0.0f, 0.0f);
-	size_t num_vis = 0;
-
-	for (auto other : gBoids) {
-		auto dist = length(pos - other->getPosition());
-		if (dist > 0.0f && dist < alignmentdist && visible(this, other)) {
-			ret += other->getVelocity();
-			num_vis++;
-		}
-	}
-
-	// Get the average vector
-	ret /= (float)num_vis;
+void FlockRenderer::draw(sf::RenderWindow &w) {
+	if (count > 0)
+		w.draw(&vertices[0], count, sf::Triangles);
+}
 
-	if (num_vis > 0)
-		return steer(ret, maxforce);
-	else
-		return sf::Vector2f(0.0f, 0.0f);
+/**
+ * Add a boid with a random position and velocity to a flock.
+ */
+void spawn(Flock &flock) {
+	auto pos   = sf::Vector2f(rnd() * WINDOWX / 2.0f, rnd() * WINDOWY / 2.0f);
+	auto angle = (rnd() + 1.0f) * M_PI;
+	auto vel   = sf::Vector2f(MAX_SPEED * cos(angle), MAX_SPEED * sin(angle));
+	flock.add(pos, vel);
 }
 
+// Simulation
+// ***********************************************************************
+
 /**
- * Compute the steering vector based on fleeing rule, ie flee if near predator.
+ * Advance both flocks by one step.
+ *
+ * @param dt   Delta time, time since last update.
+ * @param pool The threads to split the work between.
  */
-sf::Vector2f Boid::computeFlee() {
-	auto   ret     = sf::Vector2f(0.0f, 0.0f);
-	size_t num_vis = 0;
+void step(const float dt, ThreadPool &pool) {
+	// Bin the boids, and sort them so that neighbours are contiguous
+	gGrid.build(gBoids.size(), [](size_t i) { return gBoids.getPosition(i); });
+	gBoids.sort(gGrid, pool);
+
+	// Update boids, everyone reads the current frame until both flocks have
+	// stepped
+	gBoids.step(dt, pool);
+	gPredators.step(dt, pool);
+	gBoids.swap();
+	gPredators.swap();
+}
 
-	for (auto other : gPredators) {
-		auto diff = pos - other->getPosition();
-		auto dist = length(diff);
-		if (dist < fleedist && visible(this, other)) {
-			diff /= dist;
-			ret += diff;
-			num_vis++;
+/**
+ * FNV-1a hash of the exact bits of every position and velocity in a flock.
+ * Two runs only have the same checksum if they ended in the same state.
+ */
+uint64_t checksum(const Flock &flock) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < flock.size(); i++) {
+		auto  pos      = flock.getPosition(i);
+		auto  vel      = flock.getVelocity(i);
+		float state[4] = {pos.x, pos.y, vel.x, vel.y};
+
+		unsigned char bytes[sizeof(state)];
+		std::memcpy(bytes, state, sizeof(state));
+		for (auto b : bytes) {
+			hash ^= b;
+			hash *= 1099511628211ull;
 		}
 	}
-
-	// Get the average vector
-	ret /= (float)num_vis;
-
-	if (num_vis > 0) {
-		return steer(ret, 2.0f);
-	} else
-		return sf::Vector2f(0.0f, 0.0f);
+	return hash;
 }
 
+// Main
 // ***********************************************************************
 
-Predator::Predator() {
-	pos        = sf::Vector2f(rnd() * WINDOWX / 2.0f, rnd() * WINDOWY / 2.0f);
-	auto angle = (rnd() + 1.0f) * M_PI;
-	vel        = sf::Vector2f(maxspeed * cos(angle), maxspeed * sin(angle));
-	shape      = sf::CircleShape(20.0f, 3);
-	shape.setPosition(pos - sf::Vector2f(shape.getRadius(), shape.getRadius()));
-	shape.setFillColor(sf::Color::Yellow);
-}
-
-// TODO: Can I expose the weights instead of this
-void Predator::update(float dt) {
-	auto v1 = computeCohesion();
+/**
+ * Command line options.
+ */
+struct Options {
+	bool     headless  = false;        //< Run without a window
+	size_t   boids     = NUM_OBJECTS;  //< Number of boids
+	size_t   predators = 2;            //< Number of predators
+	size_t   steps     = 1000;         //< Steps to run when headless
+	float    dt        = 1.0f / 30.0f; //< Fixed timestep when headless
+	uint32_t seed      = 0;            //< Seed for the spawn positions
+	bool     seeded    = false;        //< Was a seed given?
+	size_t   threads   = std::thread::hardware_concurrency();
+};
 
-	vel += 2.0f * v1;
-	vel = maxspeed * vel / length(vel);
-	pos += vel * dt;
+/**
+ * Parse the command line, exits with a usage message on bad input.
+ */
+Options parseOptions(int argc, char **argv) {
+	Options opts;
+
+	auto usage = [&]() {
+		std::cout << "Usage: " << argv[0]
+		          << " [--headless] [--boids N] [--predators N] [--steps N]"
+		             " [--dt SECONDS] [--seed N] [--threads N]\n";
+		exit(EXIT_FAILURE);
+	};
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--headless") {
+			opts.headless = true;
+			continue;
+		}
 
-	// Wrap around the screen
-	if (pos.x > WINDOWX + shape.getRadius())
-		pos.x -= WINDOWX + shape.getRadius();
-	else if (pos.x < -shape.getRadius())
-		pos.x += WINDOWX + shape.getRadius();
+		if (i + 1 >= argc)
+			usage();
+
+		try {
+			std::string value = argv[++i];
+			if (arg == "--boids")
+				opts.boids = std::stoul(value);
+			else if (arg == "--predators")
+				opts.predators = std::stoul(value);
+			else if (arg == "--steps")
+				opts.steps = std::stoul(value);
+			else if (arg == "--dt")
+				opts.dt = std::stof(value);
+			else if (arg == "--seed") {
+				opts.seed   = std::stoul(value);
+				opts.seeded = true;
+			} else if (arg == "--threads")
+				opts.threads = std::stoul(value);
+			else
+				usage();
+		} catch (const std::logic_error &) {
+			usage();
+		}
+	}
 
-	if (pos.y > WINDOWY + shape.getRadius())
-		pos.y -= WINDOWY + shape.getRadius();
-	else if (pos.y < -shape.getRadius())
-		pos.y += WINDOWY + shape.getRadius();
+	return opts;
 }
-// Main
-// ***********************************************************************
 
-int main() {
-	// Init randomness
-	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	rnd = std::bind(distribution, generator);
+/**
+ * Run a fixed number of fixed timesteps without a window, and report how
+ * long the steps took and what state the flocks ended up in.
+ */
+int runHeadless(const Options &opts, ThreadPool &pool) {
+	std::vector<double> times;
+	times.reserve(opts.steps);
+
+	for (size_t i = 0; i < opts.steps; i++) {
+		auto start = std::chrono::steady_clock::now();
+		step(opts.dt, pool);
+		auto end = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double, std::milli>(end - start)
+		                    .count());
+	}
+
+	std::sort(times.begin(), times.end());
+	auto percentile = [&](double p) {
+		if (times.empty())
+			return 0.0;
+		return times[static_cast<size_t>(p * (times.size() - 1))];
+	};
+
+	std::cout << "boids: " << opts.boids << " predators: " << opts.predators
+	          << " steps: " << opts.steps << " dt: " << opts.dt
+	          << " seed: " << opts.seed << " threads: " << pool.size()
+	          << "\nstep time [ms]:"
+	          << " p50 " << percentile(0.50) << " p90 " << percentile(0.90)
+	          << " p99 " << percentile(0.99) << " max " << percentile(1.0)
+	          << "\nchecksum boids: " << std::hex << std::setfill('0')
+	          << std::setw(16) << checksum(gBoids)
+	          << " predators: " << std::setw(16) << checksum(gPredators)
+	          << std::dec << std::endl;
 
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Run the simulation in a window in real time.
+ */
+int runWindowed(ThreadPool &pool) {
 	// Create window
 	sf::RenderWindow window(sf::VideoMode(WINDOWX, WINDOWY), "Perlin noise");
 	window.setFramerateLimit(30);
 
-	// Setup boids
-	gBoids.resize(NUM_OBJECTS);
-	for (size_t i = 0; i < NUM_OBJECTS; i++)
-		gBoids[i] = new Boid();
-
-	gPredators.resize(2);
-	for (size_t i = 0; i < 2; i++)
-		gPredators[i] = new Predator();
+	FlockRenderer renderer;
 
 	sf::Clock clock;
 	clock.restart();
@@ -344,35 +584,45 @@ int main() {
 
 		float dt = clock.restart().asSeconds();
 
-		// Update boids
-		for (auto boid : gBoids)
-			boid->update(dt);
-
-		for (auto predator : gPredators)
-			predator->update(dt);
+		step(dt, pool);
 
 		// Rendering
 		window.clear();
 
 		// Draw boids
-		for (auto boid : gBoids)
-			boid->draw(window);
-
-		for (auto predator : gPredators)
-			predator->draw(window);
+		renderer.begin();
+		renderer.add(gBoids, sf::Color::Red);
+		renderer.add(gPredators, sf::Color::Yellow);
+		renderer.draw(window);
 
 		window.display();
 	}
 
-	// Cleanup
-	for (auto boid : gBoids)
-		delete boid;
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+	auto opts = parseOptions(argc, argv);
+
+	// Init randomness
+	// *******************************************************************
+	if (!opts.seeded) {
+		std::random_device rd;
+		opts.seed = rd();
+	}
+	rnd = Random(opts.seed);
+
+	// Setup boids
+	for (size_t i = 0; i < opts.boids; i++)
+		spawn(gBoids);
 
-	for (auto predator : gPredators)
-		delete predator;
+	for (size_t i = 0; i < opts.predators; i++)
+		spawn(gPredators);
 
-	gBoids.clear();
-	gPredators.clear();
+	ThreadPool pool(opts.threads);
 
-	return EXIT_SUCCESS;
+	if (opts.headless)
+		return runHeadless(opts, pool);
+	else
+		return runWindowed(pool);
 }
@@ -14,7 +14,24 @@
  * [Parametric GPU Accelerated
  * Particles](https://www.genericgamedev.com/effects/parametric-gpu-accelerated-particles/)
  *
- * TODO: Write a system based on transform feedback
+ * With --feedback the particles are instead simulated on the GPU with
+ * transform feedback. Every frame an update pass reads the particles from one
+ * buffer and writes them to the other, so any force can be applied through
+ * uniforms, and dead particles respawn on the GPU. The CPU uploads the
+ * particles once, and never touches them again.
+ *
+ * --headless runs the transform feedback system without a window, and checks
+ * every step against the same update done on the CPU.
+ *
+ * --offscreen renders a fixed number of frames into an offscreen
+ * framebuffer, with a fixed timestep, timing each pass on the GPU, and can
+ * dump the frames to disk. Built with ENABLE_EGL, the modes without a window
+ * use an EGL context on Mesa's surfaceless platform, and need no display.
+ *
+ * Linked shader programs are cached as binaries in shader-cache/, so shaders
+ * only compile when they changed. In a window, edited shader files are picked
+ * up while running.
+ *
  * @see [Particle System using Transform
  * Feedback](http://ogldev.atspace.co.uk/www/tutorial28/tutorial28.html)
  *
@@ -24,9 +41,17 @@
 
 #define _USE_MATH_DEFINES
 
+#include "random.h"
+
+#include <SFML/Graphics/Image.hpp>
 #include <SFML/Window.hpp>
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
 #include <functional>
 #include <glbinding-aux/debug.h>
@@ -34,7 +59,18 @@
 #include <glbinding/gl/gl.h>
 #include <glbinding/glbinding.h>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <thread>
+
+#ifdef MFP_EGL
+// Keep X11 out, its macros clash with SFML and glbinding
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 using namespace glbinding;
 using namespace gl;
@@ -45,30 +81,193 @@ static const uint32_t WINDOWX       = 1000;
 static const uint32_t WINDOWY       = 1000;
 static const size_t   MAX_OBJ_COUNT = 1000;
 
+// Parametric particles
+static const size_t EMITTER_CAPACITY  = 1 << 18; //< Particles
+static const float  PARTICLE_LIFETIME = 2.0f;    //< Seconds
+static const size_t FRAMES_IN_FLIGHT  = 3; //< Frames the GPU may lag behind
+
+// Transform feedback
+static const size_t FEEDBACK_COUNT     = 1 << 17; //< Particles
+static const float  FEEDBACK_TOLERANCE = 1e-4f;   //< Largest CPU difference
+
+// Shaders
+static const char *const SHADER_CACHE_DIR = "shader-cache"; //< Of binaries
+static const auto SHADER_POLL_INTERVAL = std::chrono::milliseconds(250);
+
 // Globals
 // ***********************************************************************
 
-std::function<float()> rnd;
+Random rnd;
 
 // Class declarations
 // ***********************************************************************
 
+/**
+ * Watches shader files for changes, on a background thread.
+ *
+ * A file is watched from the first time its version is asked for. The thread
+ * polls the modification times, and reads a file again whenever its time
+ * changes, so the thread drawing only has to compile. Every read bumps the
+ * version of the file, which is how a program tells that a file changed since
+ * it was built.
+ */
+class ShaderWatcher {
+  public:
+	ShaderWatcher();
+	~ShaderWatcher();
+
+	ShaderWatcher(const ShaderWatcher &) = delete;
+	ShaderWatcher &operator=(const ShaderWatcher &) = delete;
+
+	uint64_t    version(const std::string &path);
+	std::string source(const std::string &path);
+
+  private:
+	struct File {
+		std::filesystem::file_time_type time;
+		std::string                     source;
+		uint64_t                        version = 0;
+	};
+
+	void poll();
+
+	std::map<std::string, File> files;
+	std::mutex                  mutex;
+	std::condition_variable     wake;
+	bool                        stop = false;
+	std::thread                 thread; ///< Last, so it starts after the rest
+};
+
 /**
  * A shader program abstraction.
  *
  * Handles loading, compiling and linking shaders into a program.
+ *
+ * Linked programs are cached on disk as binaries from the driver, keyed by a
+ * hash of the sources and the driver, so the shaders are only compiled the
+ * first time, and again after they or the driver changed.
  */
 class ShaderProgram {
   public:
-	explicit ShaderProgram(std::vector<std::string> &paths);
+	explicit ShaderProgram(std::vector<std::string>  paths,
+	                       std::vector<const char *> varyings = {});
 	~ShaderProgram();
+
+	ShaderProgram(const ShaderProgram &) = delete;
+	ShaderProgram &operator=(const ShaderProgram &) = delete;
+
 	void   use();
+	bool   reload(ShaderWatcher &watcher);
 	GLuint getProgram() const { return program; }
 
   private:
-	GLuint program;
+	bool        build(GLuint target, const std::vector<std::string> &sources);
+	std::string cachePath(const std::vector<std::string> &sources) const;
+	bool        loadBinary(GLuint target, const std::string &path);
+	void        saveBinary(GLuint source, const std::string &path);
+
+	std::vector<std::string>  paths;
+	std::vector<const char *> varyings;
+	std::vector<uint64_t>     versions; ///< Of the files, see ShaderWatcher
+	GLuint                    program;
 };
 
+/**
+ * Read a whole file, with one read.
+ *
+ * @param path Path of the file
+ * @param out  Where to put the contents
+ * @return     Whether the file could be read.
+ */
+bool readFile(const std::string &path, std::string &out) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+		return false;
+
+	auto size = file.tellg();
+	if (size < 0)
+		return false;
+
+	out.resize(static_cast<size_t>(size));
+	file.seekg(0);
+	return static_cast<bool>(file.read(&out[0], out.size()));
+}
+
+/**
+ * Start polling, nothing is watched until it is asked for.
+ */
+ShaderWatcher::ShaderWatcher() : thread([this] { poll(); }) {}
+
+ShaderWatcher::~ShaderWatcher() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	thread.join();
+}
+
+/**
+ * The version of a file, which starts at 0, and is bumped every time the file
+ * changes. Starts watching the file.
+ */
+uint64_t ShaderWatcher::version(const std::string &path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto                        it = files.find(path);
+	if (it == files.end()) {
+		File            file;
+		std::error_code error;
+		file.time = std::filesystem::last_write_time(path, error);
+		readFile(path, file.source);
+		it = files.emplace(path, std::move(file)).first;
+	}
+	return it->second.version;
+}
+
+/**
+ * The source of a file, as of its last change.
+ */
+std::string ShaderWatcher::source(const std::string &path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return files[path].source;
+}
+
+/**
+ * Poll the watched files until the watcher is destroyed.
+ */
+void ShaderWatcher::poll() {
+	std::unique_lock<std::mutex> lock(mutex);
+	auto stopped = [this] { return stop; };
+	while (!wake.wait_for(lock, SHADER_POLL_INTERVAL, stopped)) {
+		std::vector<std::pair<std::string, std::filesystem::file_time_type>>
+		    known;
+		for (const auto &[path, file] : files)
+			known.emplace_back(path, file.time);
+
+		// Go to the disk without the lock, so asking for versions never waits
+		// on it
+		lock.unlock();
+		std::vector<std::pair<std::string, File>> changed;
+		for (const auto &[path, time] : known) {
+			std::error_code error;
+			File            file;
+			file.time = std::filesystem::last_write_time(path, error);
+			if (!error && file.time != time && readFile(path, file.source))
+				changed.emplace_back(path, std::move(file));
+		}
+		lock.lock();
+
+		// A half written file just fails to compile, and is read again when
+		// the writing is done
+		for (auto &[path, file] : changed) {
+			auto &watched  = files[path];
+			watched.time   = file.time;
+			watched.source = std::move(file.source);
+			watched.version++;
+		}
+	}
+}
+
 /**
  * Construct a shader program from multiple shader stages.
  *
@@ -78,29 +277,89 @@ class ShaderProgram {
  * @note Does not handle being passed multiple shaders for the same stage.
  * @note Does not handle tessellation or compute shaders
  *
- * @param paths An array of paths to the shader source code.
+ * @param paths    An array of paths to the shader source code.
+ * @param varyings Outputs to capture with transform feedback, interleaved
+ *                 into one buffer in this order.
  */
-ShaderProgram::ShaderProgram(std::vector<std::string> &paths) {
-	// Load all shaders from disk and compile them
-	std::vector<GLuint> shaders;
-	shaders.reserve(paths.size());
-	for (const auto &path : paths) {
-		// Open the file for reading
-		std::ifstream file(path, std::ifstream::in);
-		if (file.bad() || !file.is_open()) {
-			std::cout << "Error: Failed to open file\n";
+ShaderProgram::ShaderProgram(std::vector<std::string>  paths,
+                             std::vector<const char *> varyings)
+    : paths(std::move(paths)), varyings(std::move(varyings)),
+      versions(this->paths.size(), 0) {
+	// Load all shaders from disk
+	std::vector<std::string> sources(this->paths.size());
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (!readFile(this->paths[i], sources[i])) {
+			std::cout << "Error: Failed to open file " << this->paths[i]
+			          << std::endl;
 			exit(EXIT_FAILURE);
 		}
+	}
 
-		// Read in the file line by line
-		std::string source;
-		std::string line;
-		while (getline(file, line)) {
-			source.append(line + "\n");
-		}
-		// Why can I not do this?
-		// file >> source;
-		file.close();
+	program = glCreateProgram();
+	build(program, sources);
+}
+
+ShaderProgram::~ShaderProgram() { glDeleteProgram(program); }
+
+/**
+ * Use this shader program for future graphics processing.
+ */
+void ShaderProgram::use() { glUseProgram(program); }
+
+/**
+ * Build the program again if any of its files changed. If the new sources
+ * fail to compile or link, the program keeps running the old ones.
+ *
+ * @param watcher Watcher of the files
+ * @return        Whether the program was built again.
+ */
+bool ShaderProgram::reload(ShaderWatcher &watcher) {
+	bool changed = false;
+	for (size_t i = 0; i < paths.size(); i++) {
+		auto version = watcher.version(paths[i]);
+		changed |= version != versions[i];
+		versions[i] = version;
+	}
+	if (!changed)
+		return false;
+
+	std::vector<std::string> sources;
+	for (const auto &path : paths)
+		sources.push_back(watcher.source(path));
+
+	// Build a new program first, so sources with errors leave the running one
+	// alone. Then the running one, from the binary that left in the cache, so
+	// its name stays valid for everything holding it.
+	auto fresh = glCreateProgram();
+	auto built = build(fresh, sources);
+	glDeleteProgram(fresh);
+
+	return built && build(program, sources);
+}
+
+/**
+ * Build a program from the sources of its files, or load it from the cache if
+ * the same sources have been linked before.
+ *
+ * @param target  Program to build
+ * @param sources Source of each path
+ * @return        Whether the program linked, errors are printed.
+ */
+bool ShaderProgram::build(const GLuint                    target,
+                          const std::vector<std::string> &sources) {
+	auto cache = cachePath(sources);
+	if (!cache.empty() && loadBinary(target, cache)) {
+		std::cout << "Loaded program from cache: " << cache << std::endl;
+		return true;
+	}
+
+	// Compile all shaders
+	std::vector<GLuint> shaders;
+	shaders.reserve(paths.size());
+	bool compiled = true;
+	for (size_t i = 0; i < paths.size(); i++) {
+		const auto &path   = paths[i];
+		const auto &source = sources[i];
 
 		// Find the shader type
 		GLenum type;
@@ -134,129 +393,380 @@ ShaderProgram::ShaderProgram(std::vector<std::string> &paths) {
 			std::cout << "\tSource code:\n" << source << std::endl;
 			std::cout << "\tCompilation status: " << (bool)success << std::endl;
 			std::cout << "\tCompilation log:\n" << log << std::endl;
+			compiled = false;
 		}
 
 		shaders.push_back(shader);
 	}
 
 	// Build and link a shader program
-	program = glCreateProgram();
 	for (const auto shader : shaders)
-		glAttachShader(program, shader);
+		glAttachShader(target, shader);
 
-	glLinkProgram(program);
+	// Which outputs transform feedback captures is decided at link time
+	if (!varyings.empty())
+		glTransformFeedbackVaryings(target, varyings.size(), varyings.data(),
+		                            GL_INTERLEAVED_ATTRIBS);
+
+	glProgramParameteri(target, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, 1);
+	if (compiled)
+		glLinkProgram(target);
+
+	// Detach the shaders, so the program can be linked again from new ones
+	for (const auto shader : shaders) {
+		glDetachShader(target, shader);
+		glDeleteShader(shader);
+	}
+	if (!compiled)
+		return false;
 
 	// Get the link status
 	GLboolean success;
 	char      log[512];
-	glGetProgramiv(program, GL_LINK_STATUS, &success);
-	glGetProgramInfoLog(program, 512, nullptr, log);
+	glGetProgramiv(target, GL_LINK_STATUS, &success);
+	glGetProgramInfoLog(target, 512, nullptr, log);
 
 	std::cout << "Linking Program: " << std::endl;
 	if (success == GL_FALSE) {
 		std::cout << "\tLinking status: " << (bool)success << std::endl;
 		std::cout << "\tLinking log:\n" << log << std::endl;
+		return false;
 	}
 
-	for (const auto shader : shaders)
-		glDeleteShader(shader);
+	if (!cache.empty())
+		saveBinary(target, cache);
+	return true;
 }
 
-ShaderProgram::~ShaderProgram() { glDeleteProgram(program); }
+/**
+ * Path of the cached binary of the program built from sources.
+ *
+ * @return The path, or empty if the driver has no binaries to cache.
+ */
+std::string
+ShaderProgram::cachePath(const std::vector<std::string> &sources) const {
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats == 0)
+		return {};
+
+	uint64_t hash = 14695981039346656037ull;
+
+	// FNV-1a of the length and the bytes of every part of the key
+	auto add = [&](const void *data, uint64_t size) {
+		auto bytes = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < sizeof(size); i++) {
+			hash ^= (size >> (8 * i)) & 0xff;
+			hash *= 1099511628211ull;
+		}
+		for (size_t i = 0; i < size; i++) {
+			hash ^= bytes[i];
+			hash *= 1099511628211ull;
+		}
+	};
+
+	// A binary only loads in the driver that made it
+	for (auto name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+		auto string = reinterpret_cast<const char *>(glGetString(name));
+		add(string, string ? strlen(string) : 0);
+	}
+
+	// The stages follow from the paths
+	for (size_t i = 0; i < paths.size(); i++) {
+		add(paths[i].data(), paths[i].size());
+		add(sources[i].data(), sources[i].size());
+	}
+	for (auto varying : varyings)
+		add(varying, strlen(varying));
+
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.bin",
+	         static_cast<unsigned long long>(hash));
+	return SHADER_CACHE_DIR + std::string(name);
+}
 
 /**
- * Use this shader program for future graphics processing.
+ * Load a cached binary into a program.
+ *
+ * @return Whether it loaded, it does not if it was made by another driver.
  */
-void ShaderProgram::use() { glUseProgram(program); }
+bool ShaderProgram::loadBinary(const GLuint target, const std::string &path) {
+	std::string data;
+	if (!readFile(path, data) || data.size() <= sizeof(GLenum))
+		return false;
+
+	// The binary format, then the binary
+	GLenum format;
+	std::memcpy(&format, data.data(), sizeof(format));
+	glProgramBinary(target, format, data.data() + sizeof(format),
+	                data.size() - sizeof(format));
+
+	GLboolean success;
+	glGetProgramiv(target, GL_LINK_STATUS, &success);
+	return success == GL_TRUE;
+}
 
 /**
- * A simple particle.
+ * Save the binary of a linked program in the cache.
  */
-struct Particle {
-	sf::Vector2f pos; ///< The initial position of the particle
-	sf::Vector2f vel; ///< The initial velocity of the particle
-};
+void ShaderProgram::saveBinary(const GLuint source, const std::string &path) {
+	GLint length = 0;
+	glGetProgramiv(source, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	GLenum            format;
+	std::vector<char> binary(length);
+	glGetProgramBinary(source, length, nullptr, &format, binary.data());
+
+	// Write a temporary file and rename it, so another run never reads half a
+	// binary
+	std::error_code error;
+	std::filesystem::create_directories(SHADER_CACHE_DIR, error);
+
+	auto temp = path + ".tmp";
+	{
+		std::ofstream file(temp, std::ios::binary);
+		file.write(reinterpret_cast<const char *>(&format), sizeof(format));
+		file.write(binary.data(), binary.size());
+		if (!file.good())
+			error = std::make_error_code(std::errc::io_error);
+	}
+	if (!error)
+		std::filesystem::rename(temp, path, error);
+
+	if (error)
+		std::cout << "Failed to cache program: " << path << std::endl;
+}
 
 /**
- * Represents a group of particles.
+ * Make a buffer with the corners of a quad, as a triangle strip.
+ *
+ * @return The buffer, owned by the caller.
  */
-struct ParticleGroup {
-	size_t       count;    ///< Number of particles in the group
-	GLuint       vao;      ///< Vertex array object
-	GLuint       vbo;      ///< Vertex buffer object
-	sf::Vector2f acc;      ///< Constant acceleration to apply to particles
-	float        lifetime; ///< How long has the particle group been alive
+GLuint makeQuad() {
+	const float corners[] = {-1.0f, -1.0f, 1.0f, -1.0f,
+	                         -1.0f, 1.0f,  1.0f, 1.0f};
+
+	GLuint vbo;
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+	return vbo;
+}
 
-	/**
-	 * Construct a particle group of size c.
-	 *
-	 * @param c Number of particles in the group
-	 */
-	ParticleGroup(const size_t c, const sf::Vector2f a)
-	    : count(c), vao(0), vbo(0), acc(a), lifetime(0.0f) {}
+/**
+ * Read the corners of a quad from makeQuad() for an attribute of the bound
+ * vertex array, one corner per vertex.
+ */
+void bindQuad(const GLuint quad, const GLuint location) {
+	glBindBuffer(GL_ARRAY_BUFFER, quad);
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, 2, GL_FLOAT, GL_FALSE, 0, nullptr);
+}
 
-	~ParticleGroup() {
-		glDeleteBuffers(1, &vbo);
-		// FIXME: This makes the program stop drawing for some reason?, Previous
-		// mem leak was due to this.
-		glDeleteVertexArrays(1, &vao);
-	}
+/**
+ * A simple particle.
+ */
+struct Particle {
+	sf::Vector2f pos;  ///< The initial position of the particle
+	sf::Vector2f vel;  ///< The initial velocity of the particle
+	sf::Vector2f acc;  ///< Constant acceleration of the particle
+	float        time; ///< When the particle was emitted
 };
 
 /**
  * A simple particle emitter.
+ *
+ * All the particles live in one ring buffer, which stays mapped for the life
+ * of the emitter, so emitting is writing into memory, without any GL calls or
+ * GL objects made. Each particle carries the time it was emitted, and the
+ * vertex shader works out where it is from the time since.
+ *
+ * Particles are emitted in time order, so the live ones are always one range
+ * of the ring, and they are all drawn with a single draw call. Either as
+ * points expanded into quads by the geometry shader, or as instances of one
+ * shared quad. Slots are written again once their particle has expired,
+ * and the GPU is kept at most FRAMES_IN_FLIGHT frames behind. Every frame
+ * remembers the range it drew, and writing waits for the frames that drew
+ * the slots being written, so the GPU is never still reading a slot that is
+ * being written. If more particles are emitted than fit, the oldest are
+ * dropped early, and emitting then waits for the last frame to be drawn.
  */
 class ParticleEmitter {
   public:
-	explicit ParticleEmitter(GLuint program);
-	void draw(float dt);
+	ParticleEmitter(GLuint program, size_t capacity, bool instanced);
+	~ParticleEmitter();
+
+	ParticleEmitter(const ParticleEmitter &) = delete;
+	ParticleEmitter &operator=(const ParticleEmitter &) = delete;
+
+	void update(float dt);
+	void draw();
 	void emit(size_t count, sf::Vector2f pos, sf::Vector2f vel,
 	          sf::Vector2f acc, float velDeviation);
 
+	size_t size() const { return live; }
+
   private:
-	std::vector<ParticleGroup> particleGroups;
-	sf::Clock                  clock;
-	GLint                      timeLocation;
-	GLint                      accLocation;
-	GLuint                     shaderProgram;
+	/// Particles emitted at the same time
+	struct Burst {
+		size_t count;
+		float  time;
+	};
+
+	/// A frame the GPU may still be drawing
+	struct Frame {
+		GLsync fence = nullptr;
+		size_t first = 0; ///< Start of the range of the ring it draws
+		size_t count = 0;
+	};
+
+	void drop(size_t n);
+	void wait(Frame &f);
+	bool overlaps(size_t first, size_t count, const Frame &f) const;
+
+	Particle *         particles; ///< The mapped ring buffer
+	size_t             capacity;
+	size_t             tail = 0; ///< Oldest live particle
+	size_t             live = 0; ///< Live particles, from the tail on
+	std::vector<Burst> bursts;   ///< Live bursts, the oldest first
+	Frame              frames[FRAMES_IN_FLIGHT];
+	size_t             frame = 0;
+	float              time  = 0.0f; ///< Seconds run
+	bool               instanced;
+	GLuint             shaderProgram;
+	GLuint             vao;
+	GLuint             vbo;
+	GLuint             quad; ///< Corners of the shared quad, if instanced
 };
 
-ParticleEmitter::ParticleEmitter(const GLuint program) {
-	clock = sf::Clock();
-	clock.restart();
+/**
+ * Make the ring buffer, and map it for good.
+ *
+ * @param program   The program drawing the particles, fountain-gpu.vert, or
+ *                  fountain-gpu-quad.vert if instanced.
+ * @param capacity  Most particles alive at once
+ * @param instanced Draw instanced quads instead of points
+ */
+ParticleEmitter::ParticleEmitter(const GLuint program, const size_t capacity,
+                                 const bool instanced)
+    : capacity(capacity), instanced(instanced), shaderProgram(program) {
+	// Make vertex array object
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	// Make the buffer with immutable storage, which is what allows it to
+	// stay mapped while the GPU draws from it. Coherent, so writes are seen
+	// by the next draw without flushing.
+	auto flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	auto bytes = capacity * sizeof(Particle);
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferStorage(GL_ARRAY_BUFFER, bytes, nullptr, flags);
+	particles = static_cast<Particle *>(
+	    glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, flags));
+	if (particles == nullptr) {
+		std::cout << "Error: Failed to map the particle buffer\n";
+		exit(EXIT_FAILURE);
+	}
+
+	// Specify format of the data
+	auto stride = sizeof(Particle);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(Particle, pos));
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(Particle, vel));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(Particle, acc));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(Particle, time));
+
+	// One particle per instance, and the corners of the quad per vertex
+	quad = instanced ? makeQuad() : 0;
+	if (instanced) {
+		for (GLuint i = 0; i < 4; i++)
+			glVertexAttribDivisor(i, 1);
+		bindQuad(quad, 4);
+	}
 
-	// Get the location of shader uniforms for later use
-	timeLocation  = glGetUniformLocation(program, "time");
-	accLocation   = glGetUniformLocation(program, "acceleration");
-	shaderProgram = program;
+	// Unbind buffers
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
 }
 
-/**
- * Draw the particles
- */
-void ParticleEmitter::draw(float dt) {
+ParticleEmitter::~ParticleEmitter() {
+	for (auto &f : frames)
+		glDeleteSync(f.fence);
 
-	// Delete dead particle groups
-	std::cout << "ParticleGroups size: " << particleGroups.size() << std::endl;
-	particleGroups.erase(std::remove_if(particleGroups.begin(),
-	                                    particleGroups.end(),
-	                                    [](const ParticleGroup &pg) {
-		                                    return pg.lifetime > 2.0f;
-	                                    }),
-	                     particleGroups.end());
-	std::cout << "ParticleGroups size after: " << particleGroups.size()
-	          << std::endl;
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	// Draw all the particles
-	for (auto &pg : particleGroups) {
-		pg.lifetime += dt;
+	glDeleteBuffers(1, &vbo);
+	glDeleteBuffers(1, &quad);
+	glDeleteVertexArrays(1, &vao);
+}
 
-		glProgramUniform1f(shaderProgram, timeLocation, pg.lifetime);
-		glProgramUniform2f(shaderProgram, accLocation, pg.acc.x, pg.acc.y);
-		glBindVertexArray(pg.vao);
-		glDrawArrays(GL_POINTS, 0, pg.count);
-		glBindVertexArray(0);
+/**
+ * Advance the time, and expire the particles that lived out their lifetime.
+ *
+ * @param dt Delta time, time since last update.
+ */
+void ParticleEmitter::update(const float dt) {
+	time += dt;
+
+	size_t expired = 0;
+	for (const auto &burst : bursts) {
+		if (time - burst.time < PARTICLE_LIFETIME)
+			break;
+		expired += burst.count;
 	}
+	drop(expired);
+}
+
+/**
+ * Draw the particles
+ */
+void ParticleEmitter::draw() {
+	// Looked up every draw, as a reloaded program may have moved them
+	auto p = shaderProgram;
+	glUseProgram(p);
+	glProgramUniform1f(p, glGetUniformLocation(p, "time"), time);
+	glProgramUniform1f(p, glGetUniformLocation(p, "lifetime"),
+	                   PARTICLE_LIFETIME);
+	glBindVertexArray(vao);
+
+	// The live range may wrap around the end of the ring, and then it is two
+	// ranges. As points that is still one draw call, instanced it is two, as
+	// the instances of a draw can not wrap.
+	GLint   first[] = {static_cast<GLint>(tail), 0};
+	GLsizei count[] = {static_cast<GLsizei>(std::min(live, capacity - tail)),
+	                   static_cast<GLsizei>(tail + live > capacity
+	                                            ? tail + live - capacity
+	                                            : 0)};
+	if (instanced) {
+		for (size_t i = 0; i < 2; i++) {
+			if (count[i] > 0)
+				glDrawArraysInstancedBaseInstance(GL_TRIANGLE_STRIP, 0, 4,
+				                                  count[i], first[i]);
+		}
+	} else {
+		glMultiDrawArrays(GL_POINTS, first, count, count[1] > 0 ? 2 : 1);
+	}
+	glBindVertexArray(0);
+
+	// Mark the end of the frame, for emit() to wait on
+	auto &f = frames[frame % FRAMES_IN_FLIGHT];
+	glDeleteSync(f.fence);
+	f.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f.first = tail;
+	f.count = live;
+	frame++;
 }
 
 /**
@@ -265,64 +775,1079 @@ void ParticleEmitter::draw(float dt) {
  * @param count        How many particles to emit
  * @param pos          Initial position of all particles
  * @param vel          Initial velocity of all particles
+ * @param acc          Constant acceleration of all particles
  * @param velDeviation Max deviation from vel in degrees
  */
 void ParticleEmitter::emit(size_t count, sf::Vector2f pos, sf::Vector2f vel,
                            sf::Vector2f acc, float velDeviation) {
-	//	std::cout << "Emitting particles!\n";
+	count = std::min(count, capacity);
+
+	// Make room, if the ring is full
+	if (live + count > capacity)
+		drop(live + count - capacity);
 
-	std::vector<Particle> ps(count);
+	// Let the GPU catch up to FRAMES_IN_FLIGHT frames behind
+	wait(frames[frame % FRAMES_IN_FLIGHT]);
+
+	// The slots about to be written may still be drawn by a later frame, when
+	// the ring is about full, or particles were just dropped
+	auto head = tail + live;
+	for (auto &f : frames) {
+		if (overlaps(head % capacity, count, f))
+			wait(f);
+	}
+
+	auto velDiv = M_PI * velDeviation / 180.0f;
 	for (size_t i = 0; i < count; i++) {
-		auto velDiv = M_PI * velDeviation / 180.0f;
-		auto angle  = rnd() * velDiv + M_PI / 2.0f;
+		auto angle = rnd() * velDiv + M_PI / 2.0f;
+		auto speed = 0.80f * (rnd() + 1.0f);
 
-		ps[i].pos = pos;
-		ps[i].vel =
-		    sf::Vector2f(cos(angle), sin(angle)) * 0.80f * (rnd() + 1.0f);
+		particles[(head + i) % capacity] = {
+		    pos, sf::Vector2f(cos(angle), sin(angle)) * speed, acc, time};
 	}
 
-	// Upload particles
-	auto pg = ParticleGroup(count, acc);
+	live += count;
+	bursts.push_back({count, time});
+}
 
-	// Make vertex array object
-	glGenVertexArrays(1, &pg.vao);
-	glBindVertexArray(pg.vao);
+/**
+ * Wait for the GPU to finish drawing a frame, if it has not already.
+ */
+void ParticleEmitter::wait(Frame &f) {
+	if (!f.fence)
+		return;
 
-	// Make a vertex buffer and set the vertex format
-	// Make vertex buffer object
-	glGenBuffers(1, &pg.vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, pg.vbo);
+	glClientWaitSync(f.fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+	glDeleteSync(f.fence);
+	f.fence = nullptr;
+}
 
-	// Upload data
-	glBufferData(GL_ARRAY_BUFFER, ps.size() * sizeof(Particle), ps.data(),
-	             GL_STATIC_DRAW);
+/**
+ * Whether a range of the ring overlaps the range a frame draws, if the frame
+ * may still be drawing.
+ */
+bool ParticleEmitter::overlaps(const size_t first, const size_t count,
+                               const Frame &f) const {
+	if (!f.fence || count == 0 || f.count == 0)
+		return false;
+
+	// Either range starts inside the other, going around the ring
+	return (f.first + capacity - first) % capacity < count ||
+	       (first + capacity - f.first) % capacity < f.count;
+}
 
-	// Specify format of the data
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
-	                      nullptr); // Pos
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float),
-	                      (GLvoid *)(2 * sizeof(float))); // Vel
+/**
+ * Drop the n oldest particles.
+ */
+void ParticleEmitter::drop(size_t n) {
+	tail = (tail + n) % capacity;
+	live -= n;
+
+	auto it = bursts.begin();
+	for (; it != bursts.end() && n >= it->count; it++)
+		n -= it->count;
+	if (it != bursts.end())
+		it->count -= n;
+	bursts.erase(bursts.begin(), it);
+}
+
+/**
+ * A particle as stored on the GPU by the transform feedback system.
+ */
+struct GpuParticle {
+	sf::Vector2f pos;      ///< Current position
+	sf::Vector2f vel;      ///< Current velocity
+	float        age;      ///< Seconds since spawning, negative until born
+	float        lifetime; ///< Seconds the particle lives
+};
 
-	//	glDisableVertexAttribArray(1);
-	//	glDisableVertexAttribArray(0);
+/**
+ * Forces and emitter of the transform feedback system, passed to the update
+ * shader as uniforms every step, so they can change at any time.
+ */
+struct FeedbackParams {
+	sf::Vector2f gravity      = {0.3f, -0.6f};
+	sf::Vector2f wind         = {-0.4f, 0.0f};
+	float        drag         = 0.3f; ///< How fast particles take on the wind
+	sf::Vector2f emitterPos   = {0.0f, -1.0f};
+	float        emitterAngle = M_PI / 2.0f;  ///< Radians
+	float        spread       = M_PI / 6.0f;  ///< Radians to either side
+	sf::Vector2f speed        = {0.2f, 1.6f}; ///< Min and max
+	sf::Vector2f lifetimes    = {1.5f, 2.0f}; ///< Min and max
+};
+
+/**
+ * A particle system simulated on the GPU with transform feedback.
+ *
+ * The particles live in two buffers. Each update draws the particles in one
+ * buffer as points, with rasterization off, through a vertex shader that
+ * integrates them and respawns the dead ones, and captures the result into
+ * the other buffer. Then the buffers swap roles. The number of particles is
+ * fixed, a particle respawns as soon as it dies.
+ *
+ * The particles are drawn either as points expanded by the geometry shader,
+ * or as instances of one shared quad.
+ */
+class FeedbackSystem {
+  public:
+	FeedbackSystem(GLuint updateProgram, GLuint drawProgram, size_t count,
+	               bool instanced);
+	~FeedbackSystem();
+
+	FeedbackSystem(const FeedbackSystem &) = delete;
+	FeedbackSystem &operator=(const FeedbackSystem &) = delete;
+
+	void update(float dt, uint32_t seed);
+	void draw();
+	void read(std::vector<GpuParticle> &out) const;
+
+	size_t size() const { return count; }
+
+	FeedbackParams params;
+
+  private:
+	GLint uniform(const char *name) const {
+		return glGetUniformLocation(updateProgram, name);
+	}
+
+	void bindParticles(GLuint vbo, GLuint divisor);
+
+	size_t count;
+	size_t current = 0; ///< The buffer holding the latest particles
+	bool   instanced;
+	GLuint vao[2];     ///< Reads buffer i as particles
+	GLuint drawVao[2]; ///< Reads buffer i as instances, if instanced
+	GLuint vbo[2];
+	GLuint quad; ///< Corners of the shared quad, if instanced
+	GLuint updateProgram;
+	GLuint drawProgram;
+};
+
+/**
+ * Make the buffers, and upload the particles, the only upload ever.
+ *
+ * The particles start out unborn, with ages spread over the shortest
+ * lifetime, so they are born at a steady rate rather than all at once.
+ *
+ * @param updateProgram Program of fountain-gpu-update.vert
+ * @param drawProgram   Program drawing the particles, of
+ *                      fountain-gpu-particle.vert, or
+ *                      fountain-gpu-particle-quad.vert if instanced.
+ * @param count         Number of particles
+ * @param instanced     Draw instanced quads instead of points
+ */
+FeedbackSystem::FeedbackSystem(const GLuint updateProgram,
+                               const GLuint drawProgram, const size_t count,
+                               const bool instanced)
+    : count(count), instanced(instanced), updateProgram(updateProgram),
+      drawProgram(drawProgram) {
+	std::vector<GpuParticle> ps(count);
+	for (size_t i = 0; i < count; i++) {
+		ps[i].pos      = params.emitterPos;
+		ps[i].vel      = sf::Vector2f(0.0f, 0.0f);
+		ps[i].age      = -params.lifetimes.x * i / count;
+		ps[i].lifetime = 0.0f;
+	}
+
+	glGenBuffers(2, vbo);
+	for (size_t i = 0; i < 2; i++) {
+		glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
+		glBufferData(GL_ARRAY_BUFFER, count * sizeof(GpuParticle), ps.data(),
+		             GL_DYNAMIC_COPY);
+	}
+
+	glGenVertexArrays(2, vao);
+	for (size_t i = 0; i < 2; i++) {
+		glBindVertexArray(vao[i]);
+		bindParticles(vbo[i], 0);
+	}
+
+	// The instanced draw needs its own vertex arrays, as the update pass
+	// reads one particle per vertex
+	quad = instanced ? makeQuad() : 0;
+	if (instanced) {
+		glGenVertexArrays(2, drawVao);
+		for (size_t i = 0; i < 2; i++) {
+			glBindVertexArray(drawVao[i]);
+			bindParticles(vbo[i], 1);
+			bindQuad(quad, 4);
+		}
+	}
 
-	// Unbind buffers
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
 	glBindVertexArray(0);
+}
 
-	particleGroups.push_back(pg);
+/**
+ * Read the particles from a buffer, in the bound vertex array.
+ *
+ * @param vbo     The buffer
+ * @param divisor 0 to advance per vertex, or 1 per instance.
+ */
+void FeedbackSystem::bindParticles(const GLuint vbo, const GLuint divisor) {
+	// Pos, vel, age and lifetime, the same layout all the shaders read
+	auto stride = sizeof(GpuParticle);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	for (GLuint i = 0; i < 4; i++) {
+		glEnableVertexAttribArray(i);
+		glVertexAttribDivisor(i, divisor);
+	}
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(GpuParticle, pos));
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(GpuParticle, vel));
+	glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(GpuParticle, age));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride,
+	                      (GLvoid *)offsetof(GpuParticle, lifetime));
 }
 
-int main() {
-	// Init randomness
-	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	rnd = std::bind(distribution, generator);
+FeedbackSystem::~FeedbackSystem() {
+	glDeleteBuffers(2, vbo);
+	glDeleteVertexArrays(2, vao);
+	if (instanced) {
+		glDeleteBuffers(1, &quad);
+		glDeleteVertexArrays(2, drawVao);
+	}
+}
+
+/**
+ * Advance the particles by one step on the GPU.
+ *
+ * @param dt   Delta time, time since last update.
+ * @param seed Seeds the respawned particles, should differ every step.
+ */
+void FeedbackSystem::update(const float dt, const uint32_t seed) {
+	auto p = updateProgram;
+	glProgramUniform1f(p, uniform("dt"), dt);
+	glProgramUniform1ui(p, uniform("seed"), seed);
+	glProgramUniform2f(p, uniform("gravity"), params.gravity.x,
+	                   params.gravity.y);
+	glProgramUniform2f(p, uniform("wind"), params.wind.x, params.wind.y);
+	glProgramUniform1f(p, uniform("drag"), params.drag);
+	glProgramUniform2f(p, uniform("emitterPos"), params.emitterPos.x,
+	                   params.emitterPos.y);
+	glProgramUniform1f(p, uniform("emitterAngle"), params.emitterAngle);
+	glProgramUniform1f(p, uniform("spread"), params.spread);
+	glProgramUniform2f(p, uniform("speed"), params.speed.x, params.speed.y);
+	glProgramUniform2f(p, uniform("lifetimes"), params.lifetimes.x,
+	                   params.lifetimes.y);
+
+	auto next = 1 - current;
+
+	// Only the captured vertices are wanted, nothing is drawn
+	glUseProgram(updateProgram);
+	glEnable(GL_RASTERIZER_DISCARD);
+	glBindVertexArray(vao[current]);
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, vbo[next]);
+
+	glBeginTransformFeedback(GL_POINTS);
+	glDrawArrays(GL_POINTS, 0, count);
+	glEndTransformFeedback();
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	glBindVertexArray(0);
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	current = next;
+}
+
+/**
+ * Draw the latest particles.
+ */
+void FeedbackSystem::draw() {
+	glUseProgram(drawProgram);
+	if (instanced) {
+		glBindVertexArray(drawVao[current]);
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+	} else {
+		glBindVertexArray(vao[current]);
+		glDrawArrays(GL_POINTS, 0, count);
+	}
+	glBindVertexArray(0);
+}
+
+/**
+ * Copy the latest particles back from the GPU, for checking them.
+ */
+void FeedbackSystem::read(std::vector<GpuParticle> &out) const {
+	out.resize(count);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo[current]);
+	glGetBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(GpuParticle),
+	                   out.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Helper functions
+// ***********************************************************************
+
+/**
+ * PCG hash, the same as hash() in fountain-gpu-update.vert.
+ */
+uint32_t pcgHash(const uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word  = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+/**
+ * The update of fountain-gpu-update.vert on the CPU, to check the GPU
+ * against.
+ *
+ * @param ps   The particles, updated in place.
+ * @param p    Forces and emitter
+ * @param dt   Delta time, time since last update.
+ * @param seed Seeds the respawned particles
+ */
+void updateOnCpu(std::vector<GpuParticle> &ps, const FeedbackParams &p,
+                 const float dt, const uint32_t seed) {
+	for (size_t i = 0; i < ps.size(); i++) {
+		auto &particle = ps[i];
+		float age      = particle.age + dt;
+
+		if (age >= particle.lifetime) {
+			auto mix = [](float a, float b, float t) {
+				return a * (1.0f - t) + b * t;
+			};
+
+			uint32_t state = pcgHash(static_cast<uint32_t>(i) ^ seed);
+			auto random = [&state]() {
+				state = pcgHash(state);
+				return (state >> 8) * (1.0f / 16777216.0f);
+			};
+
+			float angle = p.emitterAngle + (2.0f * random() - 1.0f) * p.spread;
+			float speed = mix(p.speed.x, p.speed.y, random());
+
+			particle.pos = p.emitterPos;
+			particle.vel =
+			    sf::Vector2f(std::cos(angle), std::sin(angle)) * speed;
+			particle.age      = age - particle.lifetime;
+			particle.lifetime = mix(p.lifetimes.x, p.lifetimes.y, random());
+			continue;
+		}
+
+		if (age < 0.0f) {
+			particle.age = age;
+			continue;
+		}
+
+		auto acc = p.gravity + p.drag * (p.wind - particle.vel);
+		particle.vel += acc * dt;
+		particle.pos += particle.vel * dt;
+		particle.age = age;
+	}
+}
+
+/**
+ * Look up a GL function in the active SFML context.
+ */
+ProcAddress getSfmlFunction(const char *name) {
+	return (ProcAddress)sf::Context::getActiveContext()->getFunction(name);
+}
+
+/**
+ * Init glbinding for the active context, and the state the particles are
+ * drawn with.
+ *
+ * @param getFunction Looks up GL functions in the active context
+ */
+void initGl(ProcAddress (*getFunction)(const char *)) {
+	Binding::initialize(getFunction, true);
+
+	aux::enableGetErrorCallback();
+
+	// Setup opengl
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+}
+
+/**
+ * An offscreen framebuffer to draw into without a window.
+ *
+ * Hidden contexts may not have a default framebuffer, and drawing fails
+ * without a complete one, even with rasterization off.
+ */
+class Framebuffer {
+  public:
+	Framebuffer(GLsizei width, GLsizei height);
+	~Framebuffer();
+
+	Framebuffer(const Framebuffer &) = delete;
+	Framebuffer &operator=(const Framebuffer &) = delete;
+
+	void read(std::vector<sf::Uint8> &pixels) const;
+
+  private:
+	GLsizei width;
+	GLsizei height;
+	GLuint  fbo;
+	GLuint  rbo;
+};
 
+/**
+ * Make the framebuffer, and bind it for drawing.
+ */
+Framebuffer::Framebuffer(const GLsizei width, const GLsizei height)
+    : width(width), height(height) {
+	glGenRenderbuffers(1, &rbo);
+	glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+	                          GL_RENDERBUFFER, rbo);
+	glViewport(0, 0, width, height);
+}
+
+Framebuffer::~Framebuffer() {
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteRenderbuffers(1, &rbo);
+}
+
+/**
+ * Read back what has been drawn.
+ *
+ * @param pixels Where to put the pixels, RGBA with 8 bits per channel, the
+ *               top row first.
+ */
+void Framebuffer::read(std::vector<sf::Uint8> &pixels) const {
+	auto row = static_cast<size_t>(width) * 4;
+	pixels.resize(row * height);
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+	             pixels.data());
+
+	// GL has the bottom row first
+	for (GLsizei y = 0; y < height / 2; y++)
+		std::swap_ranges(pixels.begin() + y * row,
+		                 pixels.begin() + (y + 1) * row,
+		                 pixels.begin() + (height - 1 - y) * row);
+}
+
+/**
+ * A GL context without a window, for the modes without one.
+ *
+ * A hidden SFML context by default, which on Linux still needs a display.
+ * Built with ENABLE_EGL, it is an EGL context on Mesa's surfaceless
+ * platform instead, which needs no display at all, eg. on a render node
+ * with llvmpipe.
+ */
+class HeadlessContext {
+  public:
+	HeadlessContext();
+	~HeadlessContext();
+
+	HeadlessContext(const HeadlessContext &) = delete;
+	HeadlessContext &operator=(const HeadlessContext &) = delete;
+
+	static ProcAddress getFunction(const char *name);
+
+  private:
+#ifdef MFP_EGL
+	EGLDisplay display;
+	EGLContext context;
+#else
+	sf::Context context;
+#endif
+};
+
+#ifdef MFP_EGL
+/**
+ * Make an OpenGL 4.5 core context, with no surface, and make it current.
+ */
+HeadlessContext::HeadlessContext() {
+	auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+	    eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay == nullptr) {
+		std::cout << "Error: EGL has no eglGetPlatformDisplayEXT\n";
+		exit(EXIT_FAILURE);
+	}
+
+	display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+	                             EGL_DEFAULT_DISPLAY, nullptr);
+	if (display == EGL_NO_DISPLAY ||
+	    !eglInitialize(display, nullptr, nullptr) ||
+	    !eglBindAPI(EGL_OPENGL_API)) {
+		std::cout << "Error: Failed to init surfaceless EGL\n";
+		exit(EXIT_FAILURE);
+	}
+
+	const EGLint attribs[] = {EGL_CONTEXT_MAJOR_VERSION,
+	                          4,
+	                          EGL_CONTEXT_MINOR_VERSION,
+	                          5,
+	                          EGL_CONTEXT_OPENGL_PROFILE_MASK,
+	                          EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+	                          EGL_NONE};
+	context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT,
+	                           attribs);
+	if (context == EGL_NO_CONTEXT ||
+	    !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		std::cout << "Error: Failed to make an EGL context, error "
+		          << eglGetError() << std::endl;
+		exit(EXIT_FAILURE);
+	}
+}
+
+HeadlessContext::~HeadlessContext() {
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroyContext(display, context);
+	eglTerminate(display);
+}
+
+ProcAddress HeadlessContext::getFunction(const char *name) {
+	return (ProcAddress)eglGetProcAddress(name);
+}
+#else
+/**
+ * Make a hidden OpenGL 4.5 core context, and make it current.
+ */
+HeadlessContext::HeadlessContext()
+    : context(sf::ContextSettings(0, 0, 0, 4, 5,
+                                  sf::ContextSettings::Attribute::Core),
+              1, 1) {}
+
+HeadlessContext::~HeadlessContext() {}
+
+ProcAddress HeadlessContext::getFunction(const char *name) {
+	return getSfmlFunction(name);
+}
+#endif
+
+/**
+ * Times the passes of each frame on the GPU, with timer queries.
+ *
+ * Every frame in flight has its own queries, and a frame's results are read
+ * when its queries come around again, FRAMES_IN_FLIGHT frames later. So the
+ * timing never makes the CPU wait for the GPU.
+ * The first frame is not timed.
+ */
+class PassTimer {
+  public:
+	explicit PassTimer(std::vector<std::string> names);
+	~PassTimer();
+
+	PassTimer(const PassTimer &) = delete;
+	PassTimer &operator=(const PassTimer &) = delete;
+
+	void begin(size_t pass);
+	void end();
+	void endFrame();
+	void finish();
+	void print() const;
+
+  private:
+	/// Milliseconds a pass took
+	struct Stats {
+		double total = 0.0;
+		double min   = HUGE_VAL;
+		double max   = 0.0;
+		size_t count = 0;
+	};
+
+	void collect(size_t slot);
+
+	std::vector<std::string> names;
+	std::vector<GLuint>      queries; ///< Per frame in flight, per pass
+	std::vector<bool>        pending; ///< Has a result not read yet
+	std::vector<Stats>       stats;   ///< Per pass
+	size_t                   frame = 0;
+};
+
+/**
+ * @param names Name of each pass
+ */
+PassTimer::PassTimer(std::vector<std::string> names)
+    : names(std::move(names)) {
+	auto passes = this->names.size();
+	queries.resize(FRAMES_IN_FLIGHT * passes);
+	pending.resize(queries.size(), false);
+	stats.resize(passes);
+	glGenQueries(queries.size(), queries.data());
+}
+
+PassTimer::~PassTimer() { glDeleteQueries(queries.size(), queries.data()); }
+
+/**
+ * Start timing a pass, the passes of a frame must not overlap.
+ */
+void PassTimer::begin(const size_t pass) {
+	auto i = (frame % FRAMES_IN_FLIGHT) * names.size() + pass;
+	glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+	pending[i] = true;
+}
+
+/**
+ * Stop timing the current pass.
+ */
+void PassTimer::end() { glEndQuery(GL_TIME_ELAPSED); }
+
+/**
+ * Move on to the next frame, and read the results of the frame that used its
+ * queries last.
+ */
+void PassTimer::endFrame() {
+	// The first frame pays for everything done on first use, like allocating
+	// and compiling in the driver, so it is left out
+	if (frame == 0)
+		std::fill(pending.begin(), pending.begin() + names.size(), false);
+
+	frame++;
+	collect(frame % FRAMES_IN_FLIGHT);
+}
+
+/**
+ * Read the results of every frame still in flight.
+ */
+void PassTimer::finish() {
+	for (size_t slot = 0; slot < FRAMES_IN_FLIGHT; slot++)
+		collect(slot);
+}
+
+void PassTimer::collect(const size_t slot) {
+	for (size_t pass = 0; pass < names.size(); pass++) {
+		auto i = slot * names.size() + pass;
+		if (!pending[i])
+			continue;
+
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &ns);
+		pending[i] = false;
+
+		auto &s = stats[pass];
+		auto  ms = ns / 1e6;
+		s.total += ms;
+		s.min = std::min(s.min, ms);
+		s.max = std::max(s.max, ms);
+		s.count++;
+	}
+}
+
+/**
+ * Print the mean, min and max time of each pass.
+ */
+void PassTimer::print() const {
+	for (size_t pass = 0; pass < names.size(); pass++) {
+		auto &s = stats[pass];
+		if (s.count == 0)
+			continue;
+
+		std::cout << names[pass] << " gpu ms: mean " << s.total / s.count
+		          << " min " << s.min << " max " << s.max << "\n";
+	}
+}
+
+/**
+ * The fountain, with the particle system and the way of drawing it chosen
+ * at startup.
+ */
+class Fountain {
+  public:
+	Fountain(bool feedback, bool instanced);
+
+	void step(float dt);
+	void draw();
+	void burst();
+	void reload(ShaderWatcher &watcher);
+
+	size_t size() const {
+		return emitter ? emitter->size() : system->size();
+	}
+
+  private:
+	std::unique_ptr<ShaderProgram>   update; ///< If feedback
+	std::unique_ptr<ShaderProgram>   program;
+	std::unique_ptr<ParticleEmitter> emitter; ///< If not feedback
+	std::unique_ptr<FeedbackSystem>  system;  ///< If feedback
+};
+
+/**
+ * Compile the shaders, and make the particle system.
+ *
+ * @param feedback  Simulate with transform feedback, or parametric
+ * @param instanced Draw instanced quads, or points expanded by the geometry
+ *                  shader
+ */
+Fountain::Fountain(const bool feedback, const bool instanced) {
+	std::vector<std::string> paths;
+	if (feedback && instanced)
+		paths = {"../assets/shaders/fountain-gpu-particle-quad.vert"};
+	else if (feedback)
+		paths = {"../assets/shaders/fountain-gpu-particle.vert",
+		         "../assets/shaders/fountain-gpu.geom"};
+	else if (instanced)
+		paths = {"../assets/shaders/fountain-gpu-quad.vert"};
+	else
+		paths = {"../assets/shaders/fountain-gpu.vert",
+		         "../assets/shaders/fountain-gpu.geom"};
+	paths.push_back("../assets/shaders/fountain-gpu.frag");
+	program = std::make_unique<ShaderProgram>(paths);
+
+	if (feedback) {
+		std::vector<std::string> updatePaths = {
+		    "../assets/shaders/fountain-gpu-update.vert"};
+		update = std::make_unique<ShaderProgram>(
+		    updatePaths,
+		    std::vector<const char *>{"outPos", "outVel", "outAge",
+		                              "outLifetime"});
+		system = std::make_unique<FeedbackSystem>(
+		    update->getProgram(), program->getProgram(), FEEDBACK_COUNT,
+		    instanced);
+	} else {
+		emitter = std::make_unique<ParticleEmitter>(
+		    program->getProgram(), EMITTER_CAPACITY, instanced);
+	}
+}
+
+/**
+ * Advance the particles, and emit new ones.
+ *
+ * @param dt Delta time, time since last update.
+ */
+void Fountain::step(const float dt) {
+	if (system) {
+		system->update(dt, rnd.next());
+		return;
+	}
+
+	emitter->update(dt);
+	emitter->emit(1000, sf::Vector2f(0.0f, -1.0f), sf::Vector2f(0.2f, 1.0f),
+	              sf::Vector2f(0.3f, -0.6f), 30.0f);
+}
+
+/**
+ * Draw the particles.
+ */
+void Fountain::draw() {
+	if (system)
+		system->draw();
+	else
+		emitter->draw();
+}
+
+/**
+ * Emit a burst of particles, the transform feedback system has a fixed
+ * number of particles, and ignores this.
+ */
+void Fountain::burst() {
+	if (emitter)
+		emitter->emit(10000, sf::Vector2f(0.0f, 0.0f), sf::Vector2f(0.0f, 0.5f),
+		              sf::Vector2f(0.0f, -1.0f), 60.0f);
+}
+
+/**
+ * Build the shaders again, if their files changed.
+ */
+void Fountain::reload(ShaderWatcher &watcher) {
+	program->reload(watcher);
+	if (update)
+		update->reload(watcher);
+}
+
+// Main
+// ***********************************************************************
+
+/**
+ * Command line options.
+ */
+struct Options {
+	bool        feedback  = false;        //< Simulate with transform feedback
+	bool        instanced = false;        //< Draw instanced quads
+	bool        headless  = false;        //< Check the simulation, no window
+	bool        compare   = false;        //< Time every way of drawing
+	bool        offscreen = false;        //< Render and time, no window
+	std::string dump;                     //< Directory to dump frames in
+	bool        raw       = false;        //< Dump raw RGBA, not PNG
+	size_t      frames    = 600;          //< Steps to run when headless
+	float       dt        = 1.0f / 60.0f; //< Fixed timestep when headless
+	uint32_t    seed      = 0;            //< Seed for the particles
+	bool        seeded    = false;        //< Was a seed given?
+};
+
+/**
+ * Parse the command line, exits with a usage message on bad input.
+ */
+Options parseOptions(int argc, char **argv) {
+	Options opts;
+
+	auto usage = [&]() {
+		std::cout << "Usage: " << argv[0]
+		          << " [--feedback] [--instanced]"
+		             " [--headless | --compare | --offscreen]"
+		             " [--frames N] [--dt SECONDS] [--seed N]"
+		             " [--dump DIR] [--raw]\n";
+		exit(EXIT_FAILURE);
+	};
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--feedback") {
+			opts.feedback = true;
+			continue;
+		}
+		if (arg == "--instanced") {
+			opts.instanced = true;
+			continue;
+		}
+		if (arg == "--headless") {
+			opts.headless = true;
+			continue;
+		}
+		if (arg == "--compare") {
+			opts.compare = true;
+			continue;
+		}
+		if (arg == "--offscreen") {
+			opts.offscreen = true;
+			continue;
+		}
+		if (arg == "--raw") {
+			opts.raw = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			usage();
+
+		try {
+			std::string value = argv[++i];
+			if (arg == "--frames")
+				opts.frames = std::stoul(value);
+			else if (arg == "--dt")
+				opts.dt = std::stof(value);
+			else if (arg == "--seed") {
+				opts.seed   = std::stoul(value);
+				opts.seeded = true;
+			} else if (arg == "--dump")
+				opts.dump = value;
+			else
+				usage();
+		} catch (const std::logic_error &) {
+			usage();
+		}
+	}
+
+	if (opts.dt <= 0.0f || opts.frames == 0)
+		usage();
+
+	return opts;
+}
+
+/**
+ * Run the transform feedback system without a window, and check every step
+ * against the same step done on the CPU, from the same particles.
+ *
+ * @return EXIT_SUCCESS if every particle matched.
+ */
+int runHeadless(const Options &opts) {
+	HeadlessContext context;
+	initGl(HeadlessContext::getFunction);
+	Framebuffer framebuffer(1, 1);
+
+	std::vector<std::string> updatePaths = {
+	    "../assets/shaders/fountain-gpu-update.vert"};
+	std::vector<std::string> drawPaths = {
+	    "../assets/shaders/fountain-gpu-particle.vert",
+	    "../assets/shaders/fountain-gpu.geom",
+	    "../assets/shaders/fountain-gpu.frag"};
+	ShaderProgram update(updatePaths,
+	                     {"outPos", "outVel", "outAge", "outLifetime"});
+	ShaderProgram draw(drawPaths);
+
+	FeedbackSystem system(update.getProgram(), draw.getProgram(),
+	                      FEEDBACK_COUNT, false);
+
+	std::vector<GpuParticle> gpu;
+	std::vector<GpuParticle> cpu;
+	system.read(cpu);
+
+	double gpuSeconds = 0.0;
+	float  maxError   = 0.0f;
+	size_t failed     = 0; // Particles off by more than the tolerance
+	for (size_t frame = 0; frame < opts.frames; frame++) {
+		auto seed = rnd.next();
+
+		auto start = std::chrono::steady_clock::now();
+		system.update(opts.dt, seed);
+		glFinish();
+		auto end = std::chrono::steady_clock::now();
+		gpuSeconds += std::chrono::duration<double>(end - start).count();
+
+		// Step the last GPU particles on the CPU, and compare
+		updateOnCpu(cpu, system.params, opts.dt, seed);
+		system.read(gpu);
+		for (size_t i = 0; i < gpu.size(); i++) {
+			auto &a     = gpu[i];
+			auto &b     = cpu[i];
+			float error = std::max(
+			    {std::abs(a.pos.x - b.pos.x), std::abs(a.pos.y - b.pos.y),
+			     std::abs(a.vel.x - b.vel.x), std::abs(a.vel.y - b.vel.y),
+			     std::abs(a.age - b.age), std::abs(a.lifetime - b.lifetime)});
+			if (!(error <= FEEDBACK_TOLERANCE))
+				failed++;
+			maxError = std::max(maxError, error);
+		}
+		cpu.swap(gpu);
+	}
+
+	size_t alive = 0;
+	for (const auto &p : cpu)
+		alive += p.age >= 0.0f && p.age < p.lifetime;
+
+	std::cout << "frames: " << opts.frames << " dt: " << opts.dt
+	          << " seed: " << opts.seed << " particles: " << system.size()
+	          << " alive: " << alive
+	          << "\nupdate ms/frame: " << gpuSeconds * 1e3 / opts.frames
+	          << "\nmax difference from the cpu: " << maxError
+	          << "\nparticles off by more than " << FEEDBACK_TOLERANCE << ": "
+	          << failed << "\n"
+	          << (failed == 0 ? "ok" : "FAILED") << std::endl;
+
+	return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Time the frames of every particle system, drawn both ways, without a
+ * window, so the fastest can be picked for the machine.
+ *
+ * Each is first run for a lifetime of particles untimed, so the timed frames
+ * all draw a full set of particles.
+ */
+int runCompare(const Options &opts) {
+	HeadlessContext context;
+	initGl(HeadlessContext::getFunction);
+	Framebuffer framebuffer(WINDOWX, WINDOWY);
+
+	std::cout << "frames: " << opts.frames << " dt: " << opts.dt
+	          << " size: " << WINDOWX << "x" << WINDOWY << "\n";
+
+	auto warmup = static_cast<size_t>(std::ceil(PARTICLE_LIFETIME / opts.dt));
+	for (auto feedback : {false, true}) {
+		double fastest = 0.0;
+		bool   best    = false;
+
+		for (auto instanced : {false, true}) {
+			Fountain fountain(feedback, instanced);
+
+			double seconds = 0.0;
+			for (size_t frame = 0; frame < warmup + opts.frames; frame++) {
+				auto start = std::chrono::steady_clock::now();
+				fountain.step(opts.dt);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				fountain.draw();
+				glFinish();
+				auto end = std::chrono::steady_clock::now();
+
+				if (frame >= warmup)
+					seconds +=
+					    std::chrono::duration<double>(end - start).count();
+			}
+
+			auto ms = seconds * 1e3 / opts.frames;
+			std::cout << (feedback ? "feedback" : "parametric") << " "
+			          << (instanced ? "instanced" : "geometry shader")
+			          << " ms/frame: " << ms
+			          << " particles: " << fountain.size() << std::endl;
+
+			if (!instanced || ms < fastest) {
+				fastest = ms;
+				best    = instanced;
+			}
+		}
+
+		std::cout << "fastest for " << (feedback ? "feedback" : "parametric")
+		          << ": " << (best ? "--instanced" : "geometry shader")
+		          << "\n\n";
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Render a fixed number of frames into an offscreen framebuffer, with a fixed
+ * timestep, and time each pass on the GPU. So runs are repeatable, and can be
+ * compared between machines and changes.
+ *
+ * With --dump every frame is read back and written to the directory, which
+ * must exist, as frame-NNNNN.png, or .raw for plain RGBA with --raw. Reading
+ * back stalls the pipeline, so the wall time is only meaningful without it.
+ */
+int runOffscreen(const Options &opts) {
+	HeadlessContext context;
+	initGl(HeadlessContext::getFunction);
+	Framebuffer framebuffer(WINDOWX, WINDOWY);
+
+	Fountain  fountain(opts.feedback, opts.instanced);
+	PassTimer timer({"update", "draw"});
+
+	std::vector<sf::Uint8> pixels;
+	sf::Image              image;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t frame = 0; frame < opts.frames; frame++) {
+		timer.begin(0);
+		fountain.step(opts.dt);
+		timer.end();
+
+		timer.begin(1);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		fountain.draw();
+		timer.end();
+		timer.endFrame();
+
+		if (opts.dump.empty())
+			continue;
+
+		framebuffer.read(pixels);
+
+		char name[32];
+		snprintf(name, sizeof(name), "/frame-%05zu.%s", frame,
+		         opts.raw ? "raw" : "png");
+		auto path = opts.dump + name;
+
+		bool saved;
+		if (opts.raw) {
+			std::ofstream file(path, std::ios::binary);
+			file.write(reinterpret_cast<const char *>(pixels.data()),
+			           pixels.size());
+			saved = file.good();
+		} else {
+			image.create(WINDOWX, WINDOWY, pixels.data());
+			saved = image.saveToFile(path);
+		}
+
+		if (!saved) {
+			std::cout << "Error: Failed to write " << path << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	glFinish();
+	auto end = std::chrono::steady_clock::now();
+	timer.finish();
+
+	auto seconds = std::chrono::duration<double>(end - start).count();
+	std::cout << "frames: " << opts.frames << " dt: " << opts.dt
+	          << " seed: " << opts.seed << " size: " << WINDOWX << "x"
+	          << WINDOWY << "\n"
+	          << (opts.feedback ? "feedback" : "parametric") << " "
+	          << (opts.instanced ? "instanced" : "geometry shader")
+	          << " particles: " << fountain.size()
+	          << "\nwall ms/frame: " << seconds * 1e3 / opts.frames << "\n";
+	timer.print();
+	if (!opts.dump.empty())
+		std::cout << "frames written to " << opts.dump << "\n";
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Run the fountain in a window.
+ */
+int runWindowed(const Options &opts) {
 	// Setup window
 	sf::ContextSettings context(24, 8, 0, 4, 5,
 	                            sf::ContextSettings::Attribute::Core |
@@ -341,30 +1866,11 @@ int main() {
 	          << "\n\tStencil bits: " << s.stencilBits
 	          << "\n\tAntialiasing level: " << s.antialiasingLevel << std::endl;
 
-	// Init glbindings
-	Binding::initialize(
-	    [](const char *name) {
-		    return (ProcAddress)sf::Context::getActiveContext()->getFunction(
-		        name);
-	    },
-	    true);
+	initGl(getSfmlFunction);
 
-	aux::enableGetErrorCallback();
-
-	// Setup opengl
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-
-	// Setup shaders
-	std::vector<std::string> paths = {"../assets/shaders/fountain-gpu.vert",
-	                                  "../assets/shaders/fountain-gpu.geom",
-	                                  "../assets/shaders/fountain-gpu.frag"};
-	ShaderProgram            program(paths);
-	program.use();
-
-	// Setup emitter
-	ParticleEmitter emitter(program.getProgram());
+	// Setup shaders, and the particle system
+	Fountain      fountain(opts.feedback, opts.instanced);
+	ShaderWatcher watcher;
 
 	sf::Clock clock;
 	clock.restart();
@@ -387,24 +1893,44 @@ int main() {
 				case sf::Event::KeyPressed:
 					if (event.key.code == sf::Keyboard::Space) {
 						// Generate new particles
-						emitter.emit(10000, sf::Vector2f(0.0f, 0.0f),
-						             sf::Vector2f(0.0f, 0.5f),
-						             sf::Vector2f(0.0f, -1.0f), 60.0f);
+						fountain.burst();
 					}
 
 				default: break;
 			}
 		}
 
+		// Pick up edited shaders
+		fountain.reload(watcher);
+
 		// Rendering
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		emitter.emit(1000, sf::Vector2f(0.0f, -1.0f), sf::Vector2f(0.2f, 1.0f),
-		             sf::Vector2f(0.3f, -0.6f), 30.0f);
-		emitter.draw(dt);
+		fountain.step(dt);
+		fountain.draw();
 
 		window.display();
 	}
 
 	return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+	auto opts = parseOptions(argc, argv);
+
+	// Init randomness
+	// *******************************************************************
+	if (!opts.seeded) {
+		std::random_device rd;
+		opts.seed = rd();
+	}
+	rnd = Random(opts.seed);
+
+	if (opts.headless)
+		return runHeadless(opts);
+	if (opts.compare)
+		return runCompare(opts);
+	if (opts.offscreen)
+		return runOffscreen(opts);
+	return runWindowed(opts);
+}
@@ -14,136 +14,768 @@
  */
 
 #include "common.h"
+#include "integrators.h"
+#include "random.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <new>
 
 // Constants
 // ***********************************************************************
 constexpr uint32_t WINDOWX                      = 1000;
 constexpr uint32_t WINDOWY                      = 1000;
-constexpr size_t   MAX_OBJ_COUNT                = 100000;
+constexpr size_t   MAX_OBJ_COUNT                = 1 << 20;
 constexpr float    PARTICLE_RADIUS              = 1.0f;
+constexpr float    PARTICLE_INV_MASS            = 1.0f / 2.0f;
 constexpr float    PARTICLE_EXPLOSION_TIME      = 1.0f;
-constexpr size_t   PARTICLE_SPAWN_RATE          = 50;
+constexpr float    PARTICLE_SPAWN_RATE          = 1500.0f; //< Per second
 constexpr size_t   PARTICLE_EXPLOSION_PARTICLES = 10;
+constexpr size_t   SPAWN_RANDOMS                = 4;
+constexpr size_t   GRAIN = 4096; //< Particles per chunk of work
 
-// Globals
-// ***********************************************************************
+/// The integrator the fountain runs with, see integrators.h for the others
+using DefaultIntegrator = integrators::ExplicitEuler;
 
-std::vector<class PhysicsObject *> gPhysicsObjects;
-std::function<float()>             rnd;
+// Comparing the integrators, with --integrators
+constexpr size_t   INTEGRATOR_PARTICLES = 1 << 16;
+constexpr float    INTEGRATOR_SECONDS   = 2.0f;  //< Simulated time per run
+constexpr float    INTEGRATOR_TOLERANCE = 0.5f;  //< Invisible error, in px
+constexpr uint32_t INTEGRATOR_REFERENCE = 960;   //< Steps/s of the reference
+constexpr uint32_t INTEGRATOR_DTS[]     = {480, 240, 120, 60, 30, 15}; //< /s
 
 // Class declarations
 // ***********************************************************************
 
 /**
- * A simple particle object.
+ * A particle system, stored as a structure of arrays.
+ *
+ * Each particle is a slot in a set of arrays, which are allocated once for
+ * the full capacity, so adding and removing particles never allocates. The
+ * live particles are packed at the start of the arrays. Every array is
+ * padded with one simd::Float worth of elements, so the kernel can load a
+ * full vector at the end.
+ *
+ * A particle is dead once its lifetime reaches its max lifetime. Dead
+ * particles stay in their slot until removeDead().
+ *
+ * step() splits the particles into fixed chunks of GRAIN particles, which are
+ * updated in parallel. Particles spawned by explosions go into a buffer per
+ * chunk, each with its own random stream split from the system's generator in
+ * chunk order, and are added in chunk order once every chunk is done. So the
+ * arrays are never changed while the chunks are running, and the result does
+ * not depend on the number of threads.
  */
-class PhysicsObject {
+class ParticleSystem {
   public:
-	PhysicsObject();
-	PhysicsObject(sf::Vector2f p, sf::Vector2f v);
-	void         applyForce(sf::Vector2f force);
-	void         update(float dt);
-	void         draw(sf::RenderWindow &w);
-	void         deactivate() { active = false; }
-	bool         isActive() const { return active; }
-	bool         shouldExplode() const { return explode; }
-	sf::Vector2f getPosition() const { return pos; }
-	sf::Vector2f getVelocity() const { return vel; }
-	float        getLifetime() const { return lifetime; }
+	explicit ParticleSystem(size_t capacity);
+
+	bool add(sf::Vector2f pos, sf::Vector2f vel, float maxLifetime,
+	         bool explode);
+	template <class Integrator = DefaultIntegrator>
+	void step(float dt, sf::Vector2f gravity, sf::Vector2f wind,
+	          ThreadPool &pool);
+	void removeDead();
+	void setSeed(uint64_t seed) { random = Random(seed); }
+
+	/// End the life of particle i
+	void kill(size_t i) {
+		life[i] = maxLife[i];
+		flags[i] &= ~EXPLODE;
+	}
+
+	size_t size() const { return count; }
+	size_t capacity() const { return maxCount; }
+
+	sf::Vector2f getPosition(size_t i) const { return {px[i], py[i]}; }
+	sf::Vector2f getVelocity(size_t i) const { return {vx[i], vy[i]}; }
+	float        getLifetime(size_t i) const { return life[i]; }
+	float        getMaxLifetime(size_t i) const { return maxLife[i]; }
+	bool         isAlive(size_t i) const { return life[i] < maxLife[i]; }
+	bool         shouldExplode(size_t i) const {
+		return (flags[i] & EXPLODE) != 0;
+	}
+
+	static constexpr uint8_t EXPLODE = 1 << 0; //< Bursts into more particles
 
   private:
-	sf::Vector2f    pos;
-	sf::Vector2f    vel;
-	sf::Vector2f    acc;
-	float           invMass;
-	float           lifetime;
-	float           maxLifetime;
-	bool            active;
-	bool            explode;
-	sf::CircleShape shape;
+	/// A particle waiting to be added after a step
+	struct Spawn {
+		sf::Vector2f pos;
+		sf::Vector2f vel;
+		float        maxLifetime;
+	};
+
+	template <class Integrator>
+	void integrate(size_t begin, size_t end, float dt, sf::Vector2f gravity,
+	               sf::Vector2f wind);
+	void explode(size_t begin, size_t end, Random &random,
+	             std::vector<Spawn> &out);
+	void move(size_t from, size_t to);
+
+	size_t maxCount;
+	size_t count = 0;
+	Random random; //< Splits into the streams of the chunks
+
+	std::vector<Random>             streams; //< Random stream per chunk
+	std::vector<std::vector<Spawn>> spawns;  //< Explosion particles per chunk
+
+	std::vector<float>   px, py;
+	std::vector<float>   vx, vy;
+	std::vector<float>   life;    //< Seconds since the particle spawned
+	std::vector<float>   maxLife; //< Seconds the particle lives
+	std::vector<uint8_t> flags;
 };
 
-// Class implementation
+// Globals
 // ***********************************************************************
 
-PhysicsObject::PhysicsObject() {
-	auto angle = map_range(rnd(), -1.0f, 1.0f, -135.0f, -45.0f);
-	auto speed = map_range(rnd(), -1.0f, 1.0f, 100.0f, 500.0f);
+ParticleSystem gParticles(MAX_OBJ_COUNT);
+Random         rnd;
 
-	// Can I give the object an impulse instead of setting the velocity
-	pos = sf::Vector2f(WINDOWX / 2, WINDOWY);
-	vel = sf::Vector2f(speed * cos(angle), speed * sin(angle));
-	acc = sf::Vector2f(0.0f, 0.0f);
+const sf::Vector2f GRAVITY(0.0f, 98.1f);
+const sf::Vector2f WIND(-190.0f, 0.0f);
 
-	invMass = 1.0f / 2.0f;
+/// Calls to operator new since the start, see runHeadless()
+std::atomic<size_t> gAllocations{0};
+std::atomic<size_t> gAllocatedBytes{0};
 
-	lifetime    = 0.0f;
-	maxLifetime = map_range(rnd(), -1.0f, 1.0f, 3.0f, 10.0f);
+// Allocation counting
+// ***********************************************************************
 
-	active = true;
+void *operator new(size_t size) {
+	gAllocations.fetch_add(1, std::memory_order_relaxed);
+	gAllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+	if (auto p = std::malloc(size > 0 ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
 
-	auto r  = map_range(rnd(), -1.0f, 1.0f, 0.0f, 100.0f);
-	explode = r < 5.0f;
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
 
-	shape = sf::CircleShape(PARTICLE_RADIUS, 8);
-	shape.setFillColor(sf::Color(255, 185, 20, 255));
+// Class implementation
+// ***********************************************************************
+
+/**
+ * Construct an empty particle system.
+ *
+ * @param capacity The most particles that can be alive at once
+ */
+ParticleSystem::ParticleSystem(const size_t capacity) : maxCount(capacity) {
+	for (auto a : {&px, &py, &vx, &vy, &life, &maxLife})
+		a->resize(capacity + simd::Float::width, 0.0f);
+	flags.resize(capacity + simd::Float::width, 0);
 }
 
-PhysicsObject::PhysicsObject(sf::Vector2f p, sf::Vector2f v) : PhysicsObject() {
-	pos     = p;
-	vel     = v;
-	explode = false;
+/**
+ * Add a particle.
+ *
+ * @param pos         Position
+ * @param vel         Velocity
+ * @param maxLifetime Seconds the particle lives
+ * @param explode     Does the particle burst into more particles?
+ * @return            false if the system is full, and the particle was
+ *                    dropped.
+ */
+bool ParticleSystem::add(const sf::Vector2f pos, const sf::Vector2f vel,
+                         const float maxLifetime, const bool explode) {
+	if (count >= maxCount)
+		return false;
+
+	px[count]      = pos.x;
+	py[count]      = pos.y;
+	vx[count]      = vel.x;
+	vy[count]      = vel.y;
+	life[count]    = 0.0f;
+	maxLife[count] = maxLifetime;
+	flags[count]   = explode ? EXPLODE : 0;
+	count++;
+	return true;
 }
 
-void PhysicsObject::applyForce(sf::Vector2f force) { acc += force * invMass; }
+/**
+ * Update all the particles, and explode the ones old enough to, in parallel.
+ *
+ * @param dt      Delta time, time since last update.
+ * @param gravity Gravity force
+ * @param wind    Wind force. The wind pushes each particle towards the wind
+ *                velocity, so the force is the wind minus the velocity of
+ *                the particle projected onto it.
+ * @param pool    The threads to split the chunks between.
+ * @tparam Integrator One of the integrators in integrators.h
+ */
+template <class Integrator>
+void ParticleSystem::step(const float dt, const sf::Vector2f gravity,
+                          const sf::Vector2f wind, ThreadPool &pool) {
+	auto chunks = (count + GRAIN - 1) / GRAIN;
+	if (spawns.size() < chunks) {
+		spawns.resize(chunks);
+		streams.resize(chunks);
+	}
 
-void PhysicsObject::update(float dt) {
+	// Split the streams up front, so chunk c gets the same one every run
+	for (size_t c = 0; c < chunks; c++)
+		streams[c] = random.split();
+
+	// The pool may hand out several chunks at once, split them back up so
+	// every chunk explodes the same however the work is split
+	pool.parallelFor(count, GRAIN, [&](size_t begin, size_t end) {
+		for (auto chunk = begin; chunk < end; chunk += GRAIN) {
+			auto chunkEnd = std::min(chunk + GRAIN, end);
+			integrate<Integrator>(chunk, chunkEnd, dt, gravity, wind);
+			explode(chunk, chunkEnd, streams[chunk / GRAIN],
+			        spawns[chunk / GRAIN]);
+		}
+	});
 
-	// Euler forward integration method?
-	// Are there any issues with this integration method?
-	pos += vel * dt;
-	vel += acc * dt;
-	acc *= 0.0f; // Reset acceleration to avoid accumulation
+	// Add the explosion particles, the buffers keep their memory
+	for (size_t c = 0; c < chunks; c++) {
+		for (auto &p : spawns[c])
+			add(p.pos, p.vel, p.maxLifetime, false);
+		spawns[c].clear();
+	}
+}
 
-	// Is the particle outside the screen
-	auto d       = shape.getRadius() * shape.getRadius();
-	auto outside = pos.x + d < 0.0f || pos.x > WINDOWX + d ||
-	               pos.y + d < 0.0f || pos.y > WINDOWY + d;
+/**
+ * Apply the forces, integrate, and kill the particles that ran out of
+ * lifetime or left the screen, in one pass over a range of particles.
+ *
+ * @param begin   First particle, a multiple of simd::Float::width.
+ * @param end     One past the last particle.
+ * @param dt      Delta time, time since last update.
+ * @param gravity Gravity force
+ * @param wind    Wind force
+ * @tparam Integrator One of the integrators in integrators.h
+ */
+template <class Integrator>
+void ParticleSystem::integrate(const size_t begin, const size_t end,
+                               const float dt, const sf::Vector2f gravity,
+                               const sf::Vector2f wind) {
+	using namespace simd;
+
+	auto wind2 = dot(wind, wind);
+
+	auto h       = set1(dt);
+	auto invMass = set1(PARTICLE_INV_MASS);
+	auto gx      = set1(gravity.x);
+	auto gy      = set1(gravity.y);
+	auto wx      = set1(wind.x);
+	auto wy      = set1(wind.y);
+	auto invW2   = set1(wind2 > 0.0f ? 1.0f / wind2 : 0.0f);
+
+	// A particle is outside once it is further than this off the screen
+	auto d    = PARTICLE_RADIUS * PARTICLE_RADIUS;
+	auto minP = set1(-d);
+	auto maxX = set1(WINDOWX + d);
+	auto maxY = set1(WINDOWY + d);
+
+	// The wind pushes each particle towards the wind velocity, so the force
+	// is the wind minus the velocity projected onto it
+	auto accel = [&](const integrators::State &s) {
+		auto proj = (s.vx * wx + s.vy * wy) * invW2;
+		return integrators::Acceleration{(gx + wx - wx * proj) * invMass,
+		                                 (gy + wy - wy * proj) * invMass};
+	};
+
+	for (size_t i = begin; i < end; i += Float::width) {
+		auto s  = integrators::State{load(&px[i]), load(&py[i]),
+		                             load(&vx[i]), load(&vy[i])};
+		auto l  = load(&life[i]);
+		auto ml = load(&maxLife[i]);
+
+		Integrator::step(s, h, accel);
+		l = l + h;
+
+		// Particles that reached the end of their life or went off the
+		// screen die, with the lifetime clamped so the alpha stays positive
+		auto dead = (l > ml) | (s.x < minP) | (s.x > maxX) | (s.y < minP) |
+		            (s.y > maxY);
+		l = select(dead, ml, l);
+
+		store(&px[i], s.x);
+		store(&py[i], s.y);
+		store(&vx[i], s.vx);
+		store(&vy[i], s.vy);
+		store(&life[i], l);
+	}
+}
 
-	lifetime += dt;
+/**
+ * Kill the particles in a range that are old enough to explode, and spawn
+ * new particles traveling outward from them.
+ *
+ * @param begin  First particle, the start of a chunk.
+ * @param end    One past the last particle.
+ * @param random The random stream of the chunk, rather than sharing rnd,
+ *               which is neither thread safe nor in a fixed order across
+ *               threads.
+ * @param out    Where to put the new particles.
+ */
+void ParticleSystem::explode(const size_t begin, const size_t end,
+                             Random &random, std::vector<Spawn> &out) {
+	for (auto i = begin; i < end; i++) {
+		if (!(flags[i] & EXPLODE) || !isAlive(i) ||
+		    life[i] <= PARTICLE_EXPLOSION_TIME)
+			continue;
+
+		kill(i);
+
+		for (size_t k = 0; k < PARTICLE_EXPLOSION_PARTICLES; k++) {
+			auto angle       = random.uniform(0.0f, 360.0f);
+			auto speed       = 100.0f;
+			auto vel = sf::Vector2f(speed * cos(angle), speed * sin(angle));
+			auto maxLifetime = random.uniform(3.0f, 10.0f);
+			out.push_back({getPosition(i), vel, maxLifetime});
+		}
+	}
+}
 
-	// If the particle has reached the end of it's life or gone of the screen,
-	// then we should stop drawing it
-	if (lifetime > maxLifetime || outside) {
-		active   = false;
-		lifetime = maxLifetime; // Lifetime can become negative which messes
-		                        // with the alpha
+/**
+ * Remove the dead particles, moving the last live particle into each free
+ * slot.
+ */
+void ParticleSystem::removeDead() {
+	// Iterate backwards, so the particle moved into a slot has been checked
+	for (size_t i = count; i-- > 0;) {
+		if (!isAlive(i)) {
+			move(count - 1, i);
+			count--;
+		}
 	}
 }
 
-void PhysicsObject::draw(sf::RenderWindow &w) {
-	shape.setPosition(pos);
+/**
+ * Copy particle from into slot to.
+ */
+void ParticleSystem::move(const size_t from, const size_t to) {
+	px[to]      = px[from];
+	py[to]      = py[from];
+	vx[to]      = vx[from];
+	vy[to]      = vy[from];
+	life[to]    = life[from];
+	maxLife[to] = maxLife[from];
+	flags[to]   = flags[from];
+}
+
+// Helper functions
+// ***********************************************************************
+
+/**
+ * Spawn a particle from the fountain.
+ *
+ * @param r SPAWN_RANDOMS uniform numbers in [0, 1), deciding the angle, speed,
+ *          max lifetime and whether the particle explodes.
+ * @return  false if the system is full.
+ */
+bool spawn(ParticleSystem &particles, const float *r) {
+	auto angle = map_range(r[0], 0.0f, 1.0f, -135.0f, -45.0f);
+	auto speed = map_range(r[1], 0.0f, 1.0f, 100.0f, 500.0f);
+
+	auto pos = sf::Vector2f(WINDOWX / 2, WINDOWY);
+	auto vel = sf::Vector2f(speed * cos(angle), speed * sin(angle));
+
+	auto maxLifetime = map_range(r[2], 0.0f, 1.0f, 3.0f, 10.0f);
+	auto explode     = r[3] < 0.05f;
+
+	return particles.add(pos, vel, maxLifetime, explode);
+}
+
+/**
+ * Draws all the particles with a single draw call.
+ *
+ * Every particle is written as a quad into one vertex array, which keeps its
+ * memory between frames, and the whole array is drawn at once.
+ */
+class ParticleRenderer {
+  public:
+	void update(const ParticleSystem &particles, ThreadPool &pool);
+	void draw(sf::RenderWindow &w);
+
+  private:
+	sf::VertexArray vertices{sf::Quads};
+	size_t          count = 0; //< Vertices written this frame
+};
+
+/**
+ * Write the quads of all the particles, fading from fully opaque to
+ * transparent over their lifetime.
+ *
+ * @param particles The particles to draw
+ * @param pool      The threads to split the particles between
+ */
+void ParticleRenderer::update(const ParticleSystem &particles,
+                              ThreadPool           &pool) {
+	count = 4 * particles.size();
+	if (vertices.getVertexCount() < count)
+		vertices.resize(count);
+
+	// The quad covers the same pixels as the circle used to
+	auto size = 2.0f * PARTICLE_RADIUS;
+
+	pool.parallelFor(particles.size(), GRAIN, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; i++) {
+			auto pos   = particles.getPosition(i);
+			auto alpha = map_range(particles.getLifetime(i), 0.0f,
+			                       particles.getMaxLifetime(i), 255.0f, 0.0f);
+			auto color = sf::Color(255, 185, 20, (sf::Uint8)alpha);
+
+			auto v = &vertices[4 * i];
+			v[0]   = sf::Vertex(pos, color);
+			v[1]   = sf::Vertex(pos + sf::Vector2f(size, 0.0f), color);
+			v[2]   = sf::Vertex(pos + sf::Vector2f(size, size), color);
+			v[3]   = sf::Vertex(pos + sf::Vector2f(0.0f, size), color);
+		}
+	});
+}
+
+/**
+ * Draw the particles written by the last update().
+ *
+ * @param w The SFML window that does the actual drawing
+ */
+void ParticleRenderer::draw(sf::RenderWindow &w) {
+	if (count > 0)
+		w.draw(&vertices[0], count, sf::Quads);
+}
+
+// Simulation
+// ***********************************************************************
+
+/**
+ * Spawns particles at a steady rate per second, however long the steps are.
+ */
+class Emitter {
+  public:
+	explicit Emitter(float rate) : rate(rate) {}
+
+	/**
+	 * Spawn the particles due during a step, the fraction of a particle left
+	 * over is carried to the next step.
+	 */
+	void emit(ParticleSystem &particles, const float dt) {
+		carry += rate * dt;
+		auto due = static_cast<size_t>(carry);
+		carry -= due;
+
+		// Draw the random numbers for all of them in one go. Leave room to
+		// spare, as the count due goes up and down by one between steps.
+		if (randoms.size() < due * SPAWN_RANDOMS)
+			randoms.resize(2 * due * SPAWN_RANDOMS);
+		rnd.fill(randoms.data(), due * SPAWN_RANDOMS, 0.0f, 1.0f);
+
+		for (size_t i = 0; i < due; i++) {
+			if (!spawn(particles, &randoms[i * SPAWN_RANDOMS])) {
+				carry = 0.0f;
+				return;
+			}
+		}
+	}
+
+  private:
+	float              rate;         //< Particles per second
+	float              carry = 0.0f; //< Particles due but not spawned yet
+	std::vector<float> randoms;      //< Random numbers for this step
+};
+
+/**
+ * Advance the fountain by one step.
+ *
+ * @param dt      Delta time, time since last update.
+ * @param emitter Spawns the new particles
+ * @param pool    The threads to split the work between.
+ */
+void step(const float dt, Emitter &emitter, ThreadPool &pool) {
+	// Free the slots of the particles that died last step
+	gParticles.removeDead();
 
-	// Transition from fully opaque to transparent over the lifetime of the
-	// particle
-	auto color = shape.getFillColor();
-	color.a    = map_range(lifetime, 0.0f, maxLifetime, 255.0f, 0.0f);
-	shape.setFillColor(color);
+	// Spawn new particles, until the system is full
+	emitter.emit(gParticles, dt);
 
-	w.draw(shape);
+	// Forces, integration, culling and explosions
+	gParticles.step(dt, GRAVITY, WIND, pool);
+}
+
+/**
+ * FNV-1a hash of the exact bits of every particle. Two runs only have the
+ * same checksum if they ended in the same state.
+ */
+uint64_t checksum(const ParticleSystem &particles) {
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < particles.size(); i++) {
+		auto  pos      = particles.getPosition(i);
+		auto  vel      = particles.getVelocity(i);
+		float state[5] = {pos.x, pos.y, vel.x, vel.y,
+		                  particles.getLifetime(i)};
+
+		unsigned char bytes[sizeof(state)];
+		std::memcpy(bytes, state, sizeof(state));
+		for (auto b : bytes) {
+			hash ^= b;
+			hash *= 1099511628211ull;
+		}
+	}
+	return hash;
 }
 
 // Main
 // ***********************************************************************
 
-int main() {
-	// Init randomness
-	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	rnd = std::bind(distribution, generator);
+/**
+ * Command line options.
+ */
+struct Options {
+	bool     headless = false;               //< Run without a window
+	bool     compare  = false;               //< Compare the integrators
+	size_t   steps    = 1000;                //< Steps to run when headless
+	float    dt       = 1.0f / 60.0f;        //< Fixed timestep when headless
+	float    rate     = PARTICLE_SPAWN_RATE; //< Particles spawned per second
+	uint32_t seed     = 0;                   //< Seed for the particles
+	bool     seeded   = false;               //< Was a seed given?
+	size_t   threads  = std::thread::hardware_concurrency();
+};
+
+/**
+ * Parse the command line, exits with a usage message on bad input.
+ */
+Options parseOptions(int argc, char **argv) {
+	Options opts;
+
+	auto usage = [&]() {
+		std::cout << "Usage: " << argv[0]
+		          << " [--headless | --integrators] [--steps N] [--dt SECONDS]"
+		             " [--rate PER_SECOND] [--seed N] [--threads N]\n";
+		exit(EXIT_FAILURE);
+	};
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--headless") {
+			opts.headless = true;
+			continue;
+		}
+		if (arg == "--integrators") {
+			opts.compare = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			usage();
+
+		try {
+			std::string value = argv[++i];
+			if (arg == "--steps")
+				opts.steps = std::stoul(value);
+			else if (arg == "--dt")
+				opts.dt = std::stof(value);
+			else if (arg == "--rate")
+				opts.rate = std::stof(value);
+			else if (arg == "--seed") {
+				opts.seed   = std::stoul(value);
+				opts.seeded = true;
+			} else if (arg == "--threads")
+				opts.threads = std::stoul(value);
+			else
+				usage();
+		} catch (const std::logic_error &) {
+			usage();
+		}
+	}
+
+	if (opts.dt <= 0.0f || opts.rate < 0.0f)
+		usage();
+
+	return opts;
+}
+
+/**
+ * Run a fixed number of fixed timesteps without a window, and report the
+ * particle throughput, and how often the steps allocated.
+ */
+int runHeadless(const Options &opts, ThreadPool &pool) {
+	Emitter emitter(opts.rate);
+
+	double updateSeconds = 0.0; // Time spent in ParticleSystem::step
+	size_t updates       = 0;   // Particles updated, summed over the steps
+	size_t peak          = 0;   // Most particles alive at once
+
+	// Allocations in the first half include the arrays growing to fit, the
+	// second half should be steady
+	auto   allocsStart = gAllocations.load();
+	auto   bytesStart  = gAllocatedBytes.load();
+	size_t allocsHalf  = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < opts.steps; i++) {
+		if (i == opts.steps / 2)
+			allocsHalf = gAllocations.load();
+
+		gParticles.removeDead();
+		emitter.emit(gParticles, opts.dt);
+
+		auto updateStart = std::chrono::steady_clock::now();
+		gParticles.step(opts.dt, GRAVITY, WIND, pool);
+		auto updateEnd = std::chrono::steady_clock::now();
+
+		updateSeconds +=
+		    std::chrono::duration<double>(updateEnd - updateStart).count();
+		updates += gParticles.size();
+		peak = std::max(peak, gParticles.size());
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	auto allocs  = gAllocations.load() - allocsStart;
+	auto bytes   = gAllocatedBytes.load() - bytesStart;
+	auto steady  = gAllocations.load() - allocsHalf;
+	auto seconds = std::chrono::duration<double>(end - start).count();
+
+	std::cout << "steps: " << opts.steps << " dt: " << opts.dt
+	          << " rate: " << opts.rate << " seed: " << opts.seed
+	          << " threads: " << pool.size() << "\ntime: " << seconds
+	          << " s particles/s: " << updates / seconds
+	          << " update ns/particle: "
+	          << (updates > 0 ? updateSeconds * 1e9 / updates : 0.0)
+	          << "\npeak live: " << peak << " final live: " << gParticles.size()
+	          << "\nallocations: " << allocs << " (" << bytes << " bytes)"
+	          << " in the last half: " << steady
+	          << "\nchecksum: " << std::hex << std::setfill('0')
+	          << std::setw(16) << checksum(gParticles) << std::dec
+	          << std::endl;
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Result of running an integrator at one timestep.
+ */
+struct IntegratorRun {
+	double nsPerStep; //< Per particle and step
+	double rmsError;  //< Position error against the reference, in pixels
+	double maxError;  //< Largest position error of any particle
+};
+
+/**
+ * Launch particles from the fountain with the same seed every time, and
+ * integrate them for INTEGRATOR_SECONDS with a fixed timestep.
+ *
+ * Nothing explodes, and the particles are never removed, so every run moves
+ * the same particles, and they can be compared one to one.
+ *
+ * @param dt        Fixed timestep
+ * @param reference Final positions to compare with, x and y interleaved, or
+ *                  empty to not compare.
+ * @param out       Where to put the final positions, x and y interleaved.
+ */
+template <class Integrator>
+IntegratorRun runIntegrator(const Options &opts, ThreadPool &pool,
+                            const float dt,
+                            const std::vector<float> &reference,
+                            std::vector<float> &out) {
+	ParticleSystem particles(INTEGRATOR_PARTICLES);
+	Random         random(opts.seed);
+
+	float r[SPAWN_RANDOMS];
+	for (size_t i = 0; i < INTEGRATOR_PARTICLES; i++) {
+		random.fill(r, SPAWN_RANDOMS, 0.0f, 1.0f);
+		r[3] = 1.0f;
+		spawn(particles, r);
+	}
 
+	auto steps = static_cast<size_t>(std::lround(INTEGRATOR_SECONDS / dt));
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < steps; i++)
+		particles.step<Integrator>(dt, GRAVITY, WIND, pool);
+	auto end = std::chrono::steady_clock::now();
+
+	IntegratorRun run{};
+	run.nsPerStep = std::chrono::duration<double, std::nano>(end - start)
+	                    .count() /
+	                double(steps * particles.size());
+
+	out.resize(2 * particles.size());
+	for (size_t i = 0; i < particles.size(); i++) {
+		auto pos       = particles.getPosition(i);
+		out[2 * i]     = pos.x;
+		out[2 * i + 1] = pos.y;
+	}
+
+	if (reference.size() == out.size()) {
+		double sum = 0.0;
+		for (size_t i = 0; i < particles.size(); i++) {
+			auto dx = double(out[2 * i]) - reference[2 * i];
+			auto dy = double(out[2 * i + 1]) - reference[2 * i + 1];
+			auto e2 = dx * dx + dy * dy;
+			sum += e2;
+			run.maxError = std::max(run.maxError, std::sqrt(e2));
+		}
+		run.rmsError = std::sqrt(sum / particles.size());
+	}
+	return run;
+}
+
+/**
+ * Run one integrator at every timestep in INTEGRATOR_DTS, and print the cost
+ * and the error of each.
+ */
+template <class Integrator>
+void compareIntegrator(const Options &opts, ThreadPool &pool,
+                       const std::vector<float> &reference) {
+	std::vector<float> out;
+	float              largest = 0.0f;
+
+	for (auto fps : INTEGRATOR_DTS) {
+		auto dt  = 1.0f / fps;
+		auto run = runIntegrator<Integrator>(opts, pool, dt, reference, out);
+		if (run.maxError < INTEGRATOR_TOLERANCE)
+			largest = dt;
+
+		// The cost of simulating a second is what decides the timestep
+		std::cout << std::left << std::setw(20) << Integrator::NAME
+		          << std::right << std::fixed << std::setprecision(2)
+		          << " dt: 1/" << std::setw(3) << fps << " ns/step: "
+		          << std::setw(5) << run.nsPerStep << " ns/second: "
+		          << std::setw(7) << run.nsPerStep * fps
+		          << std::setprecision(4) << " rms error: " << std::setw(7)
+		          << run.rmsError << " max error: " << std::setw(7)
+		          << run.maxError << "\n";
+	}
+
+	std::cout << Integrator::NAME << " largest dt within "
+	          << std::setprecision(1) << INTEGRATOR_TOLERANCE << " px: ";
+	if (largest > 0.0f)
+		std::cout << "1/" << std::lround(1.0f / largest) << "\n\n";
+	else
+		std::cout << "none\n\n";
+}
+
+/**
+ * Compare the accuracy and cost of the integrators, against a reference run
+ * of RK4 with a tiny timestep.
+ */
+int runIntegrators(const Options &opts, ThreadPool &pool) {
+	std::cout << INTEGRATOR_PARTICLES << " particles for "
+	          << INTEGRATOR_SECONDS << " s, seed: " << opts.seed
+	          << " threads: " << pool.size() << "\n\n";
+
+	std::vector<float> reference;
+	runIntegrator<integrators::RK4>(opts, pool, 1.0f / INTEGRATOR_REFERENCE,
+	                                {}, reference);
+
+	compareIntegrator<integrators::ExplicitEuler>(opts, pool, reference);
+	compareIntegrator<integrators::SemiImplicitEuler>(opts, pool, reference);
+	compareIntegrator<integrators::VelocityVerlet>(opts, pool, reference);
+	compareIntegrator<integrators::RK4>(opts, pool, reference);
+
+	return EXIT_SUCCESS;
+}
+
+/**
+ * Run the fountain in a window in real time.
+ */
+int runWindowed(const Options &opts, ThreadPool &pool) {
 	// Init sfml stuff
 	// *******************************************************************
 
@@ -159,11 +791,8 @@ int main() {
 	// Init simulation stuff
 	// *******************************************************************
 
-	gPhysicsObjects.reserve(MAX_OBJ_COUNT);
-
-	sf::Vector2f gravity(0.0f, 98.1f);
-	sf::Vector2f wind(-190.0f, 0.0f);
-	float        time = 0.0f;
+	Emitter          emitter(opts.rate);
+	ParticleRenderer renderer;
 
 	sf::Clock clock;
 	clock.restart();
@@ -188,79 +817,44 @@ int main() {
 			}
 		}
 
-		float dt = clock.restart().asSeconds();
-		time += dt;
-
-		// Delete inactive objects
-		// We have to iterate over the array backwards
-		// in order to avoid skipping an element when deleting
-		for (size_t i = gPhysicsObjects.size(); i-- > 0;) {
-			if (!gPhysicsObjects[i]->isActive()) {
-				std::swap(gPhysicsObjects[i], gPhysicsObjects.back());
-				delete gPhysicsObjects.back();
-				gPhysicsObjects.pop_back();
-			}
-		}
-
-		// Spawn new objects
-		// FIXME:
-		if (gPhysicsObjects.size() < MAX_OBJ_COUNT) {
-			// Spawn new ones
-			for (size_t i = 0; i < PARTICLE_SPAWN_RATE; i++) {
-				// Emplace_back takes the parameters of
-				// the constructor and constructs the object internally.
-				// This solves a lot of weird issues in C++
-				// gPhysicsObjects.emplace_back();
-
-				gPhysicsObjects.push_back(new PhysicsObject);
-			}
-
-			// Spawn explosions
-			for (size_t j = 0; j < gPhysicsObjects.size(); j++) {
-				auto o = gPhysicsObjects[j];
-				if (o->getLifetime() > PARTICLE_EXPLOSION_TIME &&
-				    o->shouldExplode()) {
-					std::cout << "Boom!";
-					o->deactivate();
-
-					// Spawn explosion particles
-					for (size_t i = 0; i < PARTICLE_EXPLOSION_PARTICLES; i++) {
-						auto pos = o->getPosition();
-						auto angle =
-						    map_range(rnd(), -1.0f, 1.0f, 0.0f, 360.0f);
-						auto speed = 100.0f;
-						auto vel   = sf::Vector2f(speed * cos(angle),
-                                                speed * sin(angle));
-						gPhysicsObjects.push_back(new PhysicsObject(pos, vel));
-					}
-				}
-			}
-		}
-
-		// Apply forces
-		for (auto o : gPhysicsObjects) {
-			o->applyForce(gravity);
-
-			// Apply wind force
-			auto proj_w_V = project(o->getVelocity(), wind);
-			o->applyForce(wind - proj_w_V);
-		}
-
-		// Update all physics objects
-		for (auto o : gPhysicsObjects)
-			o->update(dt);
+		step(clock.restart().asSeconds(), emitter, pool);
 
 		// Rendering
 		// ***************************************************************
 
 		window.clear();
 
-		// Draw all the physics objects
-		for (auto o : gPhysicsObjects)
-			o->draw(window);
+		renderer.update(gParticles, pool);
+		renderer.draw(window);
 
 		window.display();
 	}
 
 	return EXIT_SUCCESS;
 }
+
+/**
+ * Main entry point.
+ * @return EXIT_SUCCESS
+ */
+int main(int argc, char **argv) {
+	auto opts = parseOptions(argc, argv);
+
+	// Init randomness
+	// *******************************************************************
+	if (!opts.seeded) {
+		std::random_device rd;
+		opts.seed = rd();
+	}
+	rnd = Random(opts.seed);
+	gParticles.setSeed(rnd.next());
+
+	ThreadPool pool(opts.threads);
+
+	if (opts.compare)
+		return runIntegrators(opts, pool);
+	if (opts.headless)
+		return runHeadless(opts, pool);
+	else
+		return runWindowed(opts, pool);
+}
@@ -0,0 +1,134 @@
+/**
+ * Integrators for particles, as policies for simd kernels.
+ *
+ * Each integrator is a struct with a static step() that advances a
+ * simd::Float worth of particles by one timestep, given a callable for their
+ * acceleration. Kernels take the integrator as a template parameter, so the
+ * choice is made at compile time and the step inlines into the kernel loop.
+ *
+ * @author Dennis Kristiansen
+ * @file integrators.h
+ */
+
+#pragma once
+
+#include "simd.h"
+
+namespace integrators {
+
+using simd::Float;
+
+/// Position and velocity of a vector of particles
+struct State {
+	Float x, y;
+	Float vx, vy;
+};
+
+/// Acceleration of a vector of particles
+struct Acceleration {
+	Float x, y;
+};
+
+/**
+ * Explicit (forward) Euler, first order.
+ *
+ * The position moves with the old velocity. Cheapest, but it adds energy
+ * every step, so orbits and springs blow up unless dt is small.
+ */
+struct ExplicitEuler {
+	static constexpr const char *NAME = "explicit-euler";
+
+	template <class Accel>
+	static void step(State &s, Float h, Accel accel) {
+		auto a = accel(s);
+		s.x    = s.x + s.vx * h;
+		s.y    = s.y + s.vy * h;
+		s.vx   = s.vx + a.x * h;
+		s.vy   = s.vy + a.y * h;
+	}
+};
+
+/**
+ * Semi-implicit (symplectic) Euler, first order.
+ *
+ * The same cost as explicit Euler, but the position moves with the new
+ * velocity, which keeps the energy bounded instead of growing.
+ */
+struct SemiImplicitEuler {
+	static constexpr const char *NAME = "semi-implicit-euler";
+
+	template <class Accel>
+	static void step(State &s, Float h, Accel accel) {
+		auto a = accel(s);
+		s.vx   = s.vx + a.x * h;
+		s.vy   = s.vy + a.y * h;
+		s.x    = s.x + s.vx * h;
+		s.y    = s.y + s.vy * h;
+	}
+};
+
+/**
+ * Velocity Verlet, second order and symplectic.
+ *
+ * Two acceleration evaluations per step. Forces that depend on the velocity,
+ * like drag, are evaluated at a predicted velocity for the second one. For
+ * forces that only depend on the position this is plain Velocity Verlet, and
+ * the first evaluation could be reused from the previous step.
+ */
+struct VelocityVerlet {
+	static constexpr const char *NAME = "velocity-verlet";
+
+	template <class Accel>
+	static void step(State &s, Float h, Accel accel) {
+		auto half = h * simd::set1(0.5f);
+		auto a0   = accel(s);
+
+		s.x = s.x + (s.vx + a0.x * half) * h;
+		s.y = s.y + (s.vy + a0.y * half) * h;
+
+		auto predicted = State{s.x, s.y, s.vx + a0.x * h, s.vy + a0.y * h};
+		auto a1        = accel(predicted);
+
+		s.vx = s.vx + (a0.x + a1.x) * half;
+		s.vy = s.vy + (a0.y + a1.y) * half;
+	}
+};
+
+/**
+ * Classic Runge-Kutta, fourth order.
+ *
+ * Four acceleration evaluations per step, the most accurate per step but not
+ * symplectic, so energy drifts slowly over very long runs.
+ */
+struct RK4 {
+	static constexpr const char *NAME = "rk4";
+
+	template <class Accel>
+	static void step(State &s, Float h, Accel accel) {
+		auto half  = h * simd::set1(0.5f);
+		auto sixth = h * simd::set1(1.0f / 6.0f);
+		auto two   = simd::set1(2.0f);
+
+		// Each stage is the state advanced along the previous stage
+		auto along = [&](const State &k, const Acceleration &a, Float t) {
+			return State{s.x + k.vx * t, s.y + k.vy * t, s.vx + a.x * t,
+			             s.vy + a.y * t};
+		};
+
+		auto k1 = s;
+		auto a1 = accel(k1);
+		auto k2 = along(k1, a1, half);
+		auto a2 = accel(k2);
+		auto k3 = along(k2, a2, half);
+		auto a3 = accel(k3);
+		auto k4 = along(k3, a3, h);
+		auto a4 = accel(k4);
+
+		s.x  = s.x + (k1.vx + two * (k2.vx + k3.vx) + k4.vx) * sixth;
+		s.y  = s.y + (k1.vy + two * (k2.vy + k3.vy) + k4.vy) * sixth;
+		s.vx = s.vx + (a1.x + two * (a2.x + a3.x) + a4.x) * sixth;
+		s.vy = s.vy + (a1.y + two * (a2.y + a3.y) + a4.y) * sixth;
+	}
+};
+
+} // namespace integrators
@@ -6,6 +6,7 @@
  */
 
 #include "common.h"
+#include "random.h"
 
 constexpr uint32_t WINDOWX = 1200;
 constexpr uint32_t WINDOWY = 800;
@@ -13,10 +14,8 @@ constexpr uint32_t WINDOWY = 800;
 int main() {
 	// Init randomness
 	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	auto rnd = std::bind(distribution, generator);
+	std::random_device rd;
+	Random             rnd(rd());
 
 	size_t             n   = 10;            // The power of 2
 	size_t             len = pow(2, n) + 1; // Number of points / length of v
@@ -6,6 +6,7 @@
  */
 
 #include "common.h"
+#include "random.h"
 
 // Constants
 // ***********************************************************************
@@ -17,7 +18,7 @@ constexpr uint32_t SG_SIZE = 100;
 // Globals
 // ***********************************************************************
 std::vector<sf::Vector2f> gSeedgrid;
-std::function<float()>    rnd;
+Random                    rnd;
 
 // Helper functions
 // ***********************************************************************
@@ -152,17 +153,16 @@ float perlin3(sf::Vector2f p) {
 int main() {
 	// Init randomness
 	// *******************************************************************
-	std::random_device                    rd;
-	std::default_random_engine            generator(rd());
-	std::uniform_real_distribution<float> distribution(-1.0, 1.0);
-	rnd = std::bind(distribution, generator);
+	std::random_device rd;
+	rnd = Random(rd());
+
+	// Setup seedgrid, a random unit vector per point
+	std::vector<float> angles(SG_SIZE * SG_SIZE);
+	rnd.fill(angles.data(), angles.size(), 0.0f, 2.0f * M_PI);
 
-	// Setup seedgrid
 	gSeedgrid.resize(SG_SIZE * SG_SIZE);
-	for (size_t i = 0; i < SG_SIZE * SG_SIZE; i++) {
-		auto r       = (rnd() + 1.0f) * M_PI;
-		gSeedgrid[i] = sf::Vector2f(cos(r), sin(r));
-	}
+	for (size_t i = 0; i < SG_SIZE * SG_SIZE; i++)
+		gSeedgrid[i] = sf::Vector2f(cos(angles[i]), sin(angles[i]));
 
 	// Setup sfml stuff
 	// *******************************************************************
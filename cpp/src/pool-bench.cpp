@@ -0,0 +1,180 @@
+/**
+ * Microbenchmarks of Pool<T> against std::vector and new/delete.
+ *
+ * Every container runs the same particle churn: each frame every particle is
+ * updated, the ones that ran out of life are removed, and new ones are
+ * created until the count is back up. The lifetimes come from the same seed
+ * for every container, so they all do exactly the same work.
+ *
+ * Usage: pool-bench [particles] [frames]
+ *
+ * @author Dennis Kristiansen
+ * @file pool-bench.cpp
+ */
+
+#include "pool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Constants
+// ***********************************************************************
+constexpr size_t   DEFAULT_PARTICLES = 100000;
+constexpr size_t   DEFAULT_FRAMES    = 500;
+constexpr uint32_t MAX_LIFETIME      = 120; //< Frames a particle lives
+constexpr float    DT                = 1.0f / 60.0f;
+
+// Workload
+// ***********************************************************************
+
+/**
+ * A particle about the size of the ones in the fountain.
+ */
+struct Particle {
+	explicit Particle(uint32_t life) : life(life) {}
+
+	/// Move the particle, and return whether it is still alive
+	bool update() {
+		vy += 98.1f * DT;
+		px += vx * DT;
+		py += vy * DT;
+		return --life > 0;
+	}
+
+	float    px = 0.0f;
+	float    py = 0.0f;
+	float    vx = 10.0f;
+	float    vy = -100.0f;
+	uint32_t life;
+};
+
+/**
+ * A small LCG, so every container gets the same lifetimes.
+ */
+struct Lifetimes {
+	uint32_t state = 1;
+
+	uint32_t next() {
+		state = state * 1664525u + 1013904223u;
+		return 1 + (state >> 8) % MAX_LIFETIME;
+	}
+};
+
+/**
+ * Time a run of the churn, and print the result.
+ *
+ * @param name   Name of the container
+ * @param frames Number of frames the run does
+ * @param count  Number of live particles
+ * @param run    Callable running all the frames, returning a checksum so the
+ *               work can't be optimized away
+ */
+template <class Run>
+void bench(const std::string &name, size_t frames, size_t count, Run run) {
+	auto start = std::chrono::steady_clock::now();
+	auto sum   = run();
+	auto end   = std::chrono::steady_clock::now();
+
+	auto ns = std::chrono::duration<double, std::nano>(end - start).count();
+	std::cout << std::left << std::setw(24) << name << std::right
+	          << std::setw(10) << std::fixed << std::setprecision(2)
+	          << ns / 1e6 << " ms " << std::setw(8)
+	          << ns / double(frames * count) << " ns/particle"
+	          << "  (checksum " << sum << ")" << std::endl;
+}
+
+// Containers
+// ***********************************************************************
+
+/// Pool<T>, slots reused in place
+double runPool(size_t frames, size_t count) {
+	Lifetimes      lifetimes;
+	Pool<Particle> pool(count);
+	double         sum = 0.0;
+
+	for (size_t f = 0; f < frames; f++) {
+		pool.map([&](Particle &p) {
+			sum += p.py;
+			return p.update();
+		});
+
+		while (!pool.full())
+			pool.create(lifetimes.next());
+	}
+	return sum;
+}
+
+/// std::vector<T> by value, swap with the last one and pop to remove
+double runVector(size_t frames, size_t count) {
+	Lifetimes             lifetimes;
+	std::vector<Particle> particles;
+	double                sum = 0.0;
+
+	particles.reserve(count);
+	for (size_t f = 0; f < frames; f++) {
+		for (size_t i = particles.size(); i-- > 0;) {
+			sum += particles[i].py;
+			if (!particles[i].update()) {
+				particles[i] = particles.back();
+				particles.pop_back();
+			}
+		}
+
+		while (particles.size() < count)
+			particles.emplace_back(lifetimes.next());
+	}
+	return sum;
+}
+
+/// std::vector<T *>, a new and a delete for every particle
+double runNewDelete(size_t frames, size_t count) {
+	Lifetimes               lifetimes;
+	std::vector<Particle *> particles;
+	double                  sum = 0.0;
+
+	particles.reserve(count);
+	for (size_t f = 0; f < frames; f++) {
+		for (size_t i = particles.size(); i-- > 0;) {
+			sum += particles[i]->py;
+			if (!particles[i]->update()) {
+				delete particles[i];
+				particles[i] = particles.back();
+				particles.pop_back();
+			}
+		}
+
+		while (particles.size() < count)
+			particles.push_back(new Particle(lifetimes.next()));
+	}
+
+	for (auto p : particles)
+		delete p;
+	return sum;
+}
+
+// Main
+// ***********************************************************************
+
+int main(int argc, char **argv) {
+	auto count  = argc > 1 ? std::stoul(argv[1]) : DEFAULT_PARTICLES;
+	auto frames = argc > 2 ? std::stoul(argv[2]) : DEFAULT_FRAMES;
+	if (count == 0 || frames == 0) {
+		std::cout << "Usage: " << argv[0] << " [particles] [frames]\n";
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << count << " particles, " << frames << " frames\n";
+
+	bench("Pool<T>", frames, count, [&] { return runPool(frames, count); });
+	bench("std::vector<T>", frames, count,
+	      [&] { return runVector(frames, count); });
+	bench("new/delete", frames, count,
+	      [&] { return runNewDelete(frames, count); });
+
+	return EXIT_SUCCESS;
+}
@@ -7,75 +7,160 @@
 
 #pragma once
 
-#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <utility>
 #include <vector>
 
 /**
  * A generic object pool.
  *
- * Allocates objects when the pool is full. So that creating a new object never
- * fails.
+ * Objects live in fixed size chunks of raw memory, and are constructed and
+ * destroyed in place. The pool grows a chunk at a time as it fills up, and
+ * keeps its chunks when objects are removed, so the slots are reused and a
+ * pool that has reached its working size never allocates again. Growing never
+ * moves the objects already in the pool, so references to them stay valid.
  *
- * @tparam T Type of the object stored in the pool.
+ * The live objects are always packed at the start of the pool. Removing an
+ * object moves the last live object into its slot, so objects do not keep
+ * their index, or their address, when others are removed.
+ *
+ * @tparam T         Type of the object stored in the pool.
+ * @tparam ChunkSize Number of objects per chunk, must be a power of two.
  */
-template <class T>
+template <class T, size_t ChunkSize = 1024>
 class Pool {
+	static_assert(ChunkSize > 0 && (ChunkSize & (ChunkSize - 1)) == 0,
+	              "ChunkSize must be a power of two");
+
   public:
-	Pool(size_t size = MIN_SIZE);
-	T &    create();
-	void   map(std::function<bool(T &)> fn);
-	size_t size() const { return firstDead; }
+	explicit Pool(size_t capacity = SIZE_MAX);
+	~Pool() { clear(); }
 
-  private:
-	static const size_t MIN_SIZE = 100;
-	static const size_t MAX_SIZE = 1000;
+	Pool(const Pool &) = delete;
+	Pool &operator=(const Pool &) = delete;
 
-	size_t firstDead = 0;
+	template <class... Args>
+	T *create(Args &&...args);
 
-	T *mem = nullptr;
-};
+	template <class Fn>
+	void map(Fn fn);
 
-template <class T>
-Pool<T>::Pool(size_t size) {
-	mem = (T *)malloc(size);
-}
+	void remove(size_t i);
+	void reserve(size_t n);
+	void clear();
+
+	T &      operator[](size_t i) { return *slot(i); }
+	const T &operator[](size_t i) const { return *slot(i); }
+
+	size_t size() const { return count; }
+	size_t capacity() const { return maxSize; }
+	bool   full() const { return count >= maxSize; }
+
+  private:
+	/// Uninitialized memory for one object
+	struct alignas(T) Slot {
+		unsigned char bytes[sizeof(T)];
+	};
 
-template <class T>
-T &Pool<T>::create() {
-	// Find next unused
-	// Tag it as used
-	// Return reference to the object
+	T *slot(size_t i) const {
+		return std::launder(
+		    reinterpret_cast<T *>(&chunks[i / ChunkSize][i % ChunkSize]));
+	}
 
-	auto index = firstDead;
-	firstDead += 1;
+	size_t                               maxSize;
+	size_t                               count = 0; ///< Live objects
+	std::vector<std::unique_ptr<Slot[]>> chunks;
+};
 
-	// Init mem[index]?
+/**
+ * Construct an empty pool, no memory is allocated until it is needed.
+ *
+ * @param capacity The most objects the pool can hold at once.
+ */
+template <class T, size_t ChunkSize>
+Pool<T, ChunkSize>::Pool(const size_t capacity) : maxSize(capacity) {}
 
-	return mem[index];
+/**
+ * Create an object in the first unused slot.
+ *
+ * @param args Arguments passed on to the constructor of T.
+ * @return     The new object, or nullptr if the pool is full.
+ */
+template <class T, size_t ChunkSize>
+template <class... Args>
+T *Pool<T, ChunkSize>::create(Args &&...args) {
+	if (full())
+		return nullptr;
+
+	if (count == chunks.size() * ChunkSize)
+		chunks.emplace_back(new Slot[ChunkSize]);
+
+	auto obj = new (slot(count)) T(std::forward<Args>(args)...);
+	count++;
+	return obj;
 }
 
-template <class T>
-void Pool<T>::map(std::function<bool(T &)> const fn) {
-	// Iterate over all the objects in the pool
-	// Run function with active objects as param
-	// The lambda returns whether or not the object is active
-	// If the object is no longer active, swap it with the last active one, and
-	// set new firstDead
-
-	// Iterate over pool backwards
-	for (size_t i = firstDead; i-- > 0;) {
-		if (!fn(mem[i])) {
-			std::swap(mem[i], mem[firstDead - 1]);
-			firstDead -= 1;
+/**
+ * Run a function on every object in the pool, and remove the objects it
+ * returns false for.
+ *
+ * Objects created by fn are not visited.
+ *
+ * @param fn Callable taking a T &, returning whether the object is still
+ *           alive.
+ */
+template <class T, size_t ChunkSize>
+template <class Fn>
+void Pool<T, ChunkSize>::map(Fn fn) {
+	// Iterate over the pool backwards, so the object moved into a removed
+	// slot has been visited already. A chunk at a time, so the inner loop
+	// runs over plain contiguous memory.
+	for (size_t c = (count + ChunkSize - 1) / ChunkSize; c-- > 0;) {
+		auto objs = slot(c * ChunkSize);
+		for (size_t i = std::min(count - c * ChunkSize, ChunkSize); i-- > 0;) {
+			if (!fn(objs[i]))
+				remove(c * ChunkSize + i);
 		}
 	}
 }
 
-void test_object_pool() {
-	//    Pool<bool> pool;
-	//    bool b = true;
-	//    auto fn = [b](bool &state){ state = b; return true; };
+/**
+ * Destroy object i, and move the last object into its slot.
+ */
+template <class T, size_t ChunkSize>
+void Pool<T, ChunkSize>::remove(const size_t i) {
+	auto last = slot(count - 1);
+	if (i != count - 1)
+		*slot(i) = std::move(*last);
+
+	last->~T();
+	count--;
+}
+
+/**
+ * Allocate chunks until there is room for n objects.
+ */
+template <class T, size_t ChunkSize>
+void Pool<T, ChunkSize>::reserve(const size_t n) {
+	while (chunks.size() * ChunkSize < n)
+		chunks.emplace_back(new Slot[ChunkSize]);
+}
 
+/**
+ * Destroy all the objects, but keep the memory for reuse.
+ */
+template <class T, size_t ChunkSize>
+void Pool<T, ChunkSize>::clear() {
+	for (size_t i = count; i-- > 0;)
+		slot(i)->~T();
+	count = 0;
+}
+
+void test_object_pool() {
 	Pool<int> pool;
 	auto      fn = [](int &state) {
         state = 2;
@@ -83,7 +168,7 @@ void test_object_pool() {
 	};
 
 	for (size_t i = 0; i < 50; i++)
-		pool.create() = 0;
+		pool.create(0);
 
 	pool.map(fn);
 	pool.map([](int &state) {
@@ -94,7 +179,7 @@ void test_object_pool() {
 	// Should count the number of active objects in the pool, and deactivate
 	// them
 	int count = 0;
-	pool.map([&count](int &state) {
+	pool.map([&count](int &) {
 		count++;
 		return false;
 	});
@@ -102,7 +187,7 @@ void test_object_pool() {
 
 	// The count should now be 0
 	count = 0;
-	pool.map([&count](int &state) {
+	pool.map([&count](int &) {
 		count++;
 		return false;
 	});
@@ -0,0 +1,146 @@
+/**
+ * A small, fast and reproducible pseudo random number generator.
+ *
+ * @author Dennis Kristiansen
+ * @file random.h
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * xoshiro128+, a generator with 128 bits of state.
+ *
+ * The whole state fits in a register or two, and next() is a handful of
+ * shifts and xors, so calls inline into the loops using them. The same seed
+ * always gives the same sequence, on every platform.
+ *
+ * Independent streams for threads or chunks of work are made with split(),
+ * which jumps the generator 2^64 numbers ahead. So streams split from one
+ * generator never overlap in practice.
+ *
+ * Only the upper bits are used for floats, as the lowest bits of xoshiro128+
+ * are weaker.
+ *
+ * @see [xoshiro / xoroshiro generators](https://prng.di.unimi.it/)
+ */
+class Random {
+  public:
+	explicit Random(uint64_t seed = 0);
+
+	uint32_t next();
+	void     jump();
+	Random   split();
+
+	/// A uniform float in [0, 1)
+	float uniform() { return (next() >> 8) * (1.0f / 16777216.0f); }
+
+	/// A uniform float in [min, max)
+	float uniform(float min, float max) {
+		return min + (max - min) * uniform();
+	}
+
+	/// A uniform float in [-1, 1), like the std::bind'ed distributions this
+	/// replaces
+	float operator()() { return uniform(-1.0f, 1.0f); }
+
+	void fill(float *out, size_t count, float min = -1.0f, float max = 1.0f);
+
+  private:
+	static uint32_t rotl(uint32_t x, int k) {
+		return (x << k) | (x >> (32 - k));
+	}
+
+	uint32_t s[4];
+};
+
+/**
+ * Seed the generator.
+ *
+ * The seed is expanded into the state with splitmix64, so similar seeds, like
+ * 1 and 2, still give unrelated sequences, and the state is never all zero.
+ */
+Random::Random(uint64_t seed) {
+	for (size_t i = 0; i < 4; i += 2) {
+		auto z = (seed += 0x9e3779b97f4a7c15ull);
+		z      = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z      = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		z      = z ^ (z >> 31);
+
+		s[i]     = static_cast<uint32_t>(z);
+		s[i + 1] = static_cast<uint32_t>(z >> 32);
+	}
+}
+
+/**
+ * The next 32 random bits.
+ */
+inline uint32_t Random::next() {
+	auto result = s[0] + s[3];
+	auto t      = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+
+	return result;
+}
+
+/**
+ * Advance the generator as much as 2^64 calls to next().
+ */
+void Random::jump() {
+	static const uint32_t JUMP[] = {0x8764000b, 0xf542d2d3, 0x6fa035c3,
+	                                0x77f2db5b};
+
+	uint32_t t[4] = {0, 0, 0, 0};
+	for (auto word : JUMP) {
+		for (int b = 0; b < 32; b++) {
+			if (word & (1u << b)) {
+				for (size_t i = 0; i < 4; i++)
+					t[i] ^= s[i];
+			}
+			next();
+		}
+	}
+
+	for (size_t i = 0; i < 4; i++)
+		s[i] = t[i];
+}
+
+/**
+ * Split off an independent stream.
+ *
+ * @return A generator that continues where this one was, while this one
+ *         jumps ahead past everything the returned one will produce.
+ */
+Random Random::split() {
+	auto stream = *this;
+	jump();
+	return stream;
+}
+
+/**
+ * Fill an array with uniform floats, cheaper per number than calling
+ * uniform() in a loop that does other work.
+ *
+ * @param out   Where to write the numbers
+ * @param count How many numbers to write
+ * @param min   Lower limit, inclusive
+ * @param max   Upper limit, exclusive
+ */
+void Random::fill(float *out, const size_t count, const float min,
+                  const float max) {
+	// Work on a copy of the state so it stays in registers
+	auto copy  = *this;
+	auto scale = (max - min) * (1.0f / 16777216.0f);
+	for (size_t i = 0; i < count; i++)
+		out[i] = min + (copy.next() >> 8) * scale;
+	*this = copy;
+}
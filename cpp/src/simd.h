@@ -0,0 +1,202 @@
+/**
+ * A thin wrapper over SIMD intrinsics.
+ *
+ * Kernels are written once against simd::Float and simd::Mask, and compile to
+ * AVX2, SSE2 or plain scalar code depending on what the compiler targets.
+ * Build with -march=native (ENABLE_NATIVE_ARCH in cmake) to get AVX2.
+ *
+ * @author Dennis Kristiansen
+ * @file simd.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace simd {
+
+#if defined(__AVX2__)
+
+// AVX2, 8 lanes
+// ***********************************************************************
+
+struct Float {
+	static constexpr size_t width = 8;
+	__m256                  v;
+};
+
+struct Mask {
+	__m256 v;
+};
+
+inline Float set1(float a) { return {_mm256_set1_ps(a)}; }
+inline Float load(const float *p) { return {_mm256_loadu_ps(p)}; }
+inline void  store(float *p, Float a) { _mm256_storeu_ps(p, a.v); }
+
+inline Float operator+(Float a, Float b) { return {_mm256_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm256_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm256_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm256_div_ps(a.v, b.v)}; }
+inline Float sqrt(Float a) { return {_mm256_sqrt_ps(a.v)}; }
+inline Float min(Float a, Float b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline Float max(Float a, Float b) { return {_mm256_max_ps(a.v, b.v)}; }
+
+inline Mask operator<(Float a, Float b) {
+	return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+inline Mask operator>(Float a, Float b) {
+	return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)};
+}
+inline Mask operator&(Mask a, Mask b) { return {_mm256_and_ps(a.v, b.v)}; }
+inline Mask operator|(Mask a, Mask b) { return {_mm256_or_ps(a.v, b.v)}; }
+
+/// a where the mask is set, otherwise b
+inline Float select(Mask m, Float a, Float b) {
+	return {_mm256_blendv_ps(b.v, a.v, m.v)};
+}
+
+/// One bit per lane, lane 0 in the lowest bit
+inline int bits(Mask m) { return _mm256_movemask_ps(m.v); }
+
+inline Mask fromBits(int b) {
+	auto lane = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	auto set  = _mm256_and_si256(_mm256_set1_epi32(b), lane);
+	return {_mm256_castsi256_ps(_mm256_cmpeq_epi32(set, lane))};
+}
+
+/// The first n lanes set
+inline Mask firstN(size_t n) {
+	auto lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	auto cnt  = _mm256_set1_epi32(static_cast<int>(std::min(n, Float::width)));
+	return {_mm256_castsi256_ps(_mm256_cmpgt_epi32(cnt, lane))};
+}
+
+/// Sum of all the lanes
+inline float reduce(Float a) {
+	auto s = _mm_add_ps(_mm256_castps256_ps128(a.v),
+	                    _mm256_extractf128_ps(a.v, 1));
+	s      = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s      = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#elif defined(__SSE2__) || defined(_M_X64)
+
+// SSE2, 4 lanes
+// ***********************************************************************
+
+struct Float {
+	static constexpr size_t width = 4;
+	__m128                  v;
+};
+
+struct Mask {
+	__m128 v;
+};
+
+inline Float set1(float a) { return {_mm_set1_ps(a)}; }
+inline Float load(const float *p) { return {_mm_loadu_ps(p)}; }
+inline void  store(float *p, Float a) { _mm_storeu_ps(p, a.v); }
+
+inline Float operator+(Float a, Float b) { return {_mm_add_ps(a.v, b.v)}; }
+inline Float operator-(Float a, Float b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline Float operator*(Float a, Float b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline Float operator/(Float a, Float b) { return {_mm_div_ps(a.v, b.v)}; }
+inline Float sqrt(Float a) { return {_mm_sqrt_ps(a.v)}; }
+inline Float min(Float a, Float b) { return {_mm_min_ps(a.v, b.v)}; }
+inline Float max(Float a, Float b) { return {_mm_max_ps(a.v, b.v)}; }
+
+inline Mask operator<(Float a, Float b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+inline Mask operator>(Float a, Float b) { return {_mm_cmpgt_ps(a.v, b.v)}; }
+inline Mask operator&(Mask a, Mask b) { return {_mm_and_ps(a.v, b.v)}; }
+inline Mask operator|(Mask a, Mask b) { return {_mm_or_ps(a.v, b.v)}; }
+
+/// a where the mask is set, otherwise b
+inline Float select(Mask m, Float a, Float b) {
+	return {_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v))};
+}
+
+/// One bit per lane, lane 0 in the lowest bit
+inline int bits(Mask m) { return _mm_movemask_ps(m.v); }
+
+inline Mask fromBits(int b) {
+	auto lane = _mm_setr_epi32(1, 2, 4, 8);
+	auto set  = _mm_and_si128(_mm_set1_epi32(b), lane);
+	return {_mm_castsi128_ps(_mm_cmpeq_epi32(set, lane))};
+}
+
+/// The first n lanes set
+inline Mask firstN(size_t n) {
+	auto lane = _mm_setr_epi32(0, 1, 2, 3);
+	auto cnt  = _mm_set1_epi32(static_cast<int>(std::min(n, Float::width)));
+	return {_mm_castsi128_ps(_mm_cmpgt_epi32(cnt, lane))};
+}
+
+/// Sum of all the lanes
+inline float reduce(Float a) {
+	auto s = _mm_add_ps(a.v, _mm_movehl_ps(a.v, a.v));
+	s      = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#else
+
+// Scalar fallback, 1 lane
+// ***********************************************************************
+
+struct Float {
+	static constexpr size_t width = 1;
+	float                   v;
+};
+
+struct Mask {
+	bool v;
+};
+
+inline Float set1(float a) { return {a}; }
+inline Float load(const float *p) { return {*p}; }
+inline void  store(float *p, Float a) { *p = a.v; }
+
+inline Float operator+(Float a, Float b) { return {a.v + b.v}; }
+inline Float operator-(Float a, Float b) { return {a.v - b.v}; }
+inline Float operator*(Float a, Float b) { return {a.v * b.v}; }
+inline Float operator/(Float a, Float b) { return {a.v / b.v}; }
+inline Float sqrt(Float a) { return {std::sqrt(a.v)}; }
+inline Float min(Float a, Float b) { return {a.v < b.v ? a.v : b.v}; }
+inline Float max(Float a, Float b) { return {a.v > b.v ? a.v : b.v}; }
+
+inline Mask operator<(Float a, Float b) { return {a.v < b.v}; }
+inline Mask operator>(Float a, Float b) { return {a.v > b.v}; }
+inline Mask operator&(Mask a, Mask b) { return {a.v && b.v}; }
+inline Mask operator|(Mask a, Mask b) { return {a.v || b.v}; }
+
+/// a where the mask is set, otherwise b
+inline Float select(Mask m, Float a, Float b) { return m.v ? a : b; }
+
+/// One bit per lane, lane 0 in the lowest bit
+inline int  bits(Mask m) { return m.v ? 1 : 0; }
+inline Mask fromBits(int b) { return {(b & 1) != 0}; }
+
+/// The first n lanes set
+inline Mask firstN(size_t n) { return {n > 0}; }
+
+/// Sum of all the lanes
+inline float reduce(Float a) { return a.v; }
+
+#endif
+
+inline Float operator-(Float a) { return set1(0.0f) - a; }
+
+inline Float &operator+=(Float &a, Float b) { return a = a + b; }
+inline Float &operator-=(Float &a, Float b) { return a = a - b; }
+
+} // namespace simd
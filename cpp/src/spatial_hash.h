@@ -0,0 +1,176 @@
+/**
+ * A uniform grid spatial hash for neighbour queries.
+ *
+ * @author Dennis Kristiansen
+ * @file spatial_hash.h
+ */
+
+#pragma once
+
+#include <SFML/System.hpp>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * A spatial hash over a uniform grid of square cells.
+ *
+ * The grid is rebuilt from scratch with build(), which bins every item into
+ * a hashed bucket with a counting sort. So the whole structure is a couple of
+ * flat arrays, and building it never allocates once it has grown to fit.
+ *
+ * Queries visit only the buckets of the cells overlapping the query circle.
+ * Distinct cells can hash to the same bucket, so a query can yield items that
+ * are far away. Callers are expected to do their own distance test.
+ */
+class SpatialHash {
+  public:
+	explicit SpatialHash(float cellSize);
+
+	template <class GetPos>
+	void build(size_t count, GetPos getPos);
+
+	template <class Fn>
+	void query(sf::Vector2f pos, float radius, Fn fn) const;
+
+	template <class Fn>
+	void queryBuckets(sf::Vector2f pos, float radius, Fn fn) const;
+
+	/// The item stored at slot i of the bucket sorted order
+	uint32_t item(size_t i) const { return items[i]; }
+	float    getCellSize() const { return cellSize; }
+
+  private:
+	uint32_t bucketOf(int32_t cx, int32_t cy) const;
+	int32_t  cellCoord(float v) const {
+		return static_cast<int32_t>(std::floor(v * invCellSize));
+	}
+
+	float cellSize;
+	float invCellSize;
+
+	uint32_t              mask = 0;  ///< Bucket count - 1, a power of two
+	std::vector<uint32_t> starts;    ///< First slot of each bucket, + 1 end
+	std::vector<uint32_t> items;     ///< Item indices sorted by bucket
+	std::vector<uint32_t> bucketIds; ///< Scratch, the bucket of each item
+};
+
+/**
+ * Construct an empty spatial hash.
+ *
+ * @param cellSize The side length of a cell. Queries with a radius of up to
+ *                 the cell size visit at most 3x3 cells.
+ */
+SpatialHash::SpatialHash(const float cellSize)
+    : cellSize(cellSize), invCellSize(1.0f / cellSize) {}
+
+/**
+ * Hash a cell coordinate into a bucket.
+ *
+ * @see [Optimized Spatial Hashing for Collision Detection of Deformable
+ * Objects](https://matthias-research.github.io/pages/publications/tetraederCollision.pdf)
+ */
+uint32_t SpatialHash::bucketOf(const int32_t cx, const int32_t cy) const {
+	auto h = (static_cast<uint32_t>(cx) * 73856093u) ^
+	         (static_cast<uint32_t>(cy) * 19349663u);
+	return h & mask;
+}
+
+/**
+ * Rebuild the hash from scratch.
+ *
+ * @param count  Number of items, items are identified by their index.
+ * @param getPos Callable returning the position of item i.
+ */
+template <class GetPos>
+void SpatialHash::build(const size_t count, GetPos getPos) {
+	// Keep about two buckets per item to make collisions rare
+	uint32_t buckets = 64;
+	while (buckets < 2 * count)
+		buckets *= 2;
+	mask = buckets - 1;
+
+	starts.assign(buckets + 1, 0);
+	items.resize(count);
+	bucketIds.resize(count);
+
+	// Count the items in each bucket
+	for (size_t i = 0; i < count; i++) {
+		auto p       = getPos(i);
+		auto b       = bucketOf(cellCoord(p.x), cellCoord(p.y));
+		bucketIds[i] = b;
+		starts[b + 1]++;
+	}
+
+	// Prefix sum turns the counts into start offsets
+	for (size_t b = 0; b < buckets; b++)
+		starts[b + 1] += starts[b];
+
+	// Scatter the items into their buckets, starts[b] ends up at the end of
+	// bucket b, which is the start of bucket b + 1. So shift it back after.
+	for (size_t i = 0; i < count; i++)
+		items[starts[bucketIds[i]]++] = static_cast<uint32_t>(i);
+
+	for (size_t b = buckets; b-- > 0;)
+		starts[b + 1] = starts[b];
+	starts[0] = 0;
+}
+
+/**
+ * Visit the slot range of every bucket that may contain items within radius
+ * of pos. Each bucket is visited at most once.
+ *
+ * @param pos    Center of the query.
+ * @param radius Radius of the query, no larger than the cell size.
+ * @param fn     Callable taking (size_t begin, size_t end), a range of slots
+ *               that can be resolved to items with item().
+ */
+template <class Fn>
+void SpatialHash::queryBuckets(const sf::Vector2f pos, const float radius,
+                               Fn fn) const {
+	assert(radius <= cellSize);
+
+	auto x0 = cellCoord(pos.x - radius);
+	auto x1 = cellCoord(pos.x + radius);
+	auto y0 = cellCoord(pos.y - radius);
+	auto y1 = cellCoord(pos.y + radius);
+
+	// Remember visited buckets so hash collisions do not yield an item twice.
+	// Rounding can stretch the query over 4x4 cells, never more.
+	uint32_t seen[16];
+	size_t   numSeen = 0;
+
+	for (auto cy = y0; cy <= y1; cy++) {
+		for (auto cx = x0; cx <= x1; cx++) {
+			auto b = bucketOf(cx, cy);
+
+			bool visited = false;
+			for (size_t i = 0; i < numSeen; i++)
+				visited = visited || seen[i] == b;
+			if (visited)
+				continue;
+			seen[numSeen++] = b;
+
+			if (starts[b] != starts[b + 1])
+				fn(static_cast<size_t>(starts[b]),
+				   static_cast<size_t>(starts[b + 1]));
+		}
+	}
+}
+
+/**
+ * Visit every item that may be within radius of pos.
+ *
+ * @param pos    Center of the query.
+ * @param radius Radius of the query, no larger than the cell size.
+ * @param fn     Callable taking the index of an item.
+ */
+template <class Fn>
+void SpatialHash::query(const sf::Vector2f pos, const float radius,
+                        Fn fn) const {
+	queryBuckets(pos, radius, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; i++)
+			fn(items[i]);
+	});
+}
@@ -0,0 +1,162 @@
+/**
+ * A minimal thread pool for data parallel loops.
+ *
+ * @author Dennis Kristiansen
+ * @file thread_pool.h
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that split loops between them.
+ *
+ * Work is handed out in chunks of a fixed grain size, which the threads claim
+ * from a shared atomic counter. So faster threads simply end up doing more
+ * chunks, and the calling thread does its share of the work as well.
+ */
+class ThreadPool {
+  public:
+	explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+
+	template <class Fn>
+	void parallelFor(size_t count, size_t grain, Fn fn);
+
+	/// Number of threads working on a loop, including the calling thread
+	size_t size() const { return workers.size() + 1; }
+
+  private:
+	void worker();
+	void runChunks();
+
+	std::vector<std::thread> workers;
+	std::mutex               mutex;
+	std::condition_variable  wake;
+	std::condition_variable  finished;
+	size_t                   generation = 0;
+	size_t                   active     = 0; ///< Workers inside runChunks()
+	bool                     stop       = false;
+
+	// The current loop. The callable is not owned, and is not copied into a
+	// std::function, so starting a loop never allocates.
+	void (*job)(void *fn, size_t begin, size_t end) = nullptr;
+	void               *fn                          = nullptr;
+	size_t              grain                       = 0;
+	size_t              count                       = 0;
+	std::atomic<size_t> numChunks{0};
+	std::atomic<size_t> nextChunk{0};
+	std::atomic<size_t> pending{0};
+};
+
+/**
+ * Start the worker threads.
+ *
+ * @param threads Total number of threads to use, including the thread calling
+ *                parallelFor. 0 and 1 both run everything on the caller.
+ */
+ThreadPool::ThreadPool(const size_t threads) {
+	for (size_t i = 1; i < threads; i++)
+		workers.emplace_back([this] { worker(); });
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+
+	for (auto &w : workers)
+		w.join();
+}
+
+/**
+ * Wait for loops and work on them until the pool is destroyed.
+ */
+void ThreadPool::worker() {
+	size_t seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stop || generation != seen; });
+			if (stop)
+				return;
+			seen = generation;
+			active++;
+		}
+
+		runChunks();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--active == 0)
+			finished.notify_all();
+	}
+}
+
+/**
+ * Claim and run chunks of the current loop until there are none left.
+ */
+void ThreadPool::runChunks() {
+	size_t chunk;
+	while ((chunk = nextChunk.fetch_add(1)) < numChunks) {
+		auto begin = chunk * grain;
+		job(fn, begin, std::min(begin + grain, count));
+
+		if (pending.fetch_sub(1) == 1) {
+			std::lock_guard<std::mutex> lock(mutex);
+			finished.notify_all();
+		}
+	}
+}
+
+/**
+ * Run fn over [0, count) split into chunks, and wait for all of them.
+ *
+ * @param count Number of items.
+ * @param grain Number of items per chunk.
+ * @param fn    Callable taking (size_t begin, size_t end). Called concurrently
+ *              on disjoint ranges.
+ */
+template <class Fn>
+void ThreadPool::parallelFor(const size_t count, const size_t grain, Fn fn) {
+	auto chunks = (count + grain - 1) / grain;
+	if (workers.empty() || chunks <= 1) {
+		if (count > 0)
+			fn(size_t(0), count);
+		return;
+	}
+
+	{
+		// A worker that woke up late for the previous loop might still be
+		// looking at the chunk counter, so let it leave before resetting it
+		std::unique_lock<std::mutex> lock(mutex);
+		finished.wait(lock, [&] { return active == 0; });
+
+		job = [](void *fn, size_t begin, size_t end) {
+			(*static_cast<Fn *>(fn))(begin, end);
+		};
+		this->fn    = &fn;
+		this->grain = grain;
+		this->count = count;
+		numChunks   = chunks;
+		pending   = chunks;
+		nextChunk = 0;
+		generation++;
+	}
+	wake.notify_all();
+
+	runChunks();
+
+	std::unique_lock<std::mutex> lock(mutex);
+	finished.wait(lock, [&] { return pending == 0; });
+}
@@ -0,0 +1,106 @@
+/**
+ * Compile time gated tracing into an in-memory ring buffer.
+ *
+ * Tracing is only compiled in when MFP_TRACE is defined, which cmake does
+ * with ENABLE_TRACE. Otherwise TRACE() expands to nothing, and the arguments
+ * are never evaluated.
+ *
+ * @author Dennis Kristiansen
+ * @file trace.h
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#ifdef MFP_TRACE
+#define TRACE(ring, ...) (ring).push(__VA_ARGS__)
+#else
+#define TRACE(ring, ...) ((void)0)
+#endif
+
+/**
+ * A lock-free ring buffer of the last N trace events.
+ *
+ * Any number of threads can push() at the same time. A push claims a slot
+ * with a single atomic increment, and overwrites the oldest event when the
+ * buffer is full, so it never blocks and never allocates.
+ *
+ * Each slot carries a sequence number that is odd while the slot is being
+ * written. dump() uses it to skip events that are overwritten while it is
+ * reading them, so it can run while other threads keep pushing.
+ *
+ * @tparam T Type of the events, must be trivially copyable.
+ * @tparam N Number of events kept, must be a power of two.
+ */
+template <class T, size_t N>
+class TraceRing {
+	static_assert(std::is_trivially_copyable<T>::value,
+	              "Trace events must be trivially copyable");
+	static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+	void push(const T &event);
+
+	template <class Fn>
+	void dump(Fn fn) const;
+
+	/// Number of events pushed since the start, including overwritten ones
+	uint64_t pushed() const { return head.load(std::memory_order_relaxed); }
+
+  private:
+	struct Slot {
+		std::atomic<uint64_t> seq{0};
+		T                     event;
+	};
+
+	std::atomic<uint64_t> head{0};
+	Slot                  slots[N];
+};
+
+/**
+ * Record an event, overwriting the oldest one if the buffer is full.
+ */
+template <class T, size_t N>
+void TraceRing<T, N>::push(const T &event) {
+	auto  index = head.fetch_add(1, std::memory_order_relaxed);
+	auto &slot  = slots[index & (N - 1)];
+
+	slot.seq.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.event = event;
+	slot.seq.store(2 * index + 2, std::memory_order_release);
+}
+
+/**
+ * Visit the events still in the buffer, from the oldest to the newest.
+ *
+ * @param fn Callable taking (uint64_t index, const T &event), where index
+ *           counts every event pushed since the start.
+ */
+template <class T, size_t N>
+template <class Fn>
+void TraceRing<T, N>::dump(Fn fn) const {
+	auto end   = head.load(std::memory_order_acquire);
+	auto begin = end > N ? end - N : 0;
+
+	for (auto index = begin; index < end; index++) {
+		auto &slot = slots[index & (N - 1)];
+
+		// Skip the slot if it is not done being written, or it has been
+		// overwritten by a newer event, before or while we copy it
+		auto seq = slot.seq.load(std::memory_order_acquire);
+		if (seq != 2 * index + 2)
+			continue;
+
+		T event = slot.event;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.seq.load(std::memory_order_relaxed) != seq)
+			continue;
+
+		fn(index, event);
+	}
+}